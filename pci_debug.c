@@ -15,7 +15,9 @@
  *
  * ----------------------------------------------------------------
  */
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <string.h>
 #include <fcntl.h>
@@ -24,10 +26,21 @@
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <dirent.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <byteswap.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 #include <pciaccess.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 
 /* Readline support */
@@ -81,6 +94,76 @@ typedef struct {
 	desc_ctrl_t desc_ctrl;
 } desc_info;
 
+/* DMA engine registers (BAR offsets) */
+#define DMA_RD_DOORBELL     0x14
+#define DMA_RD_LLP          0x1c
+#define DMA_WR_DOORBELL     0x2c
+#define DMA_WR_LLP          0x34
+#define DMA_STATUS          0x44
+#define DMA_STATUS_RD_BUSY  0x10
+#define DMA_STATUS_WR_BUSY  0x40
+#define DMA_DOORBELL_STOP   0x80000000
+
+/* Size of the udmabuf0 mapping */
+#define BOOT_BUFFER_SIZE    0x100000
+
+/* Streaming ring layout inside boot_buffer. The one-shot chains
+ * use the first 0x4000 bytes (descriptors, source at sizeof(desc),
+ * destination at 0x2000), so the ring lives above them.
+ */
+#define RING_WR_DESC_OFF    0x4000
+#define RING_RD_DESC_OFF    0x8000
+#define RING_SRC_OFF        0x10000
+#define RING_DST_OFF        0x88000
+#define RING_AREA_SIZE      0x78000
+#define RING_MAX_SLOTS      64
+
+/* Test pattern selection */
+typedef enum {
+	PAT_ADDR,
+	PAT_PRBS7,
+	PAT_PRBS15,
+	PAT_PRBS31,
+	PAT_WALK1,
+	PAT_WALK0,
+	PAT_RANDOM
+} pattern_kind_t;
+
+typedef struct {
+	pattern_kind_t kind;
+	uint32_t       seed;
+	int            tag;        /* embed iteration/segment tag */
+} pattern_t;
+
+/* Generator state for one segment */
+typedef struct {
+	pattern_t      pat;
+	uint32_t       iter;
+	uint32_t       segment;
+	uint32_t       base;
+	uint32_t       key;
+	uint32_t       word;       /* words produced so far */
+	uint32_t       lfsr;
+	uint32_t       order;
+	uint32_t       shift;
+	uint64_t       acc;
+	uint32_t       nacc;
+} pattern_gen_t;
+
+/* Dump formatting options */
+typedef enum {
+	DUMP_ADDR_OFFSET,          /* BAR or buffer offset */
+	DUMP_ADDR_BUS,             /* bus (physical) address */
+	DUMP_ADDR_VIRT             /* process virtual address */
+} dump_addr_mode_t;
+
+typedef struct {
+	int              group;    /* bytes per group: 1, 2, 4 or 8 */
+	int              ascii;    /* append an ASCII column */
+	int              squeeze;  /* collapse repeated lines to '*' */
+	dump_addr_mode_t addr_mode;
+} dump_opts_t;
+
 void display_help(device_t *dev);
 void parse_command(device_t *dev);
 int process_command(device_t *dev, char *cmd);
@@ -88,11 +171,156 @@ int change_mem(device_t *dev, char *cmd);
 int fill_mem(device_t *dev, char *cmd);
 int display_mem(device_t *dev, char *cmd);
 int change_endian(device_t *dev, char *cmd);
+int ring_stream(device_t *dev, char *cmd);
+int pio_bench(device_t *dev, char *cmd);
+int snap_mem(device_t *dev, char *cmd);
+int diff_mem(device_t *dev, char *cmd);
+int find_mem(device_t *dev, char *cmd);
+int pattern_select(device_t *dev, char *cmd);
+int dump_format(device_t *dev, char *cmd);
+int dump_buffer_cmd(device_t *dev, char *cmd);
+void dump_data(const void *data, uint32_t len, uint64_t label, int digits,
+	uint32_t line_bytes, int group);
+void dump_buffer(const void *addr, uint32_t len, uint32_t line_bytes);
+void pattern_fill(const pattern_t *pat, uint32_t iter, void *buf, uint32_t len,
+	uint32_t seg, uint32_t base);
+int pattern_check(const pattern_t *pat, uint32_t iter, const void *buf, uint32_t len,
+	uint32_t seg, uint32_t base);
+int placement_setup(device_t *dev);
+int placement_check_buffer(void);
+int dma_prepare(void);
+void placement_pin_thread(pthread_t thread, int worker);
+/* Link error state of the endpoint [0] and its upstream port [1] */
+#define LINK_PORTS          2
+#define LINK_ERRORS         1
+#define LINK_EVENTS         2
+
+typedef struct {
+	int      present;          /* sysfs device found */
+	int      aer;              /* AER counters readable */
+	int      status;           /* PCIe status registers readable */
+	uint64_t count[3];         /* correctable, nonfatal, fatal */
+	uint16_t devsta;
+	uint16_t lnksta;
+} link_port_t;
+
+typedef struct {
+	link_port_t port[LINK_PORTS];
+} link_health_t;
+
+int cfg_access(const char *dir, int write, unsigned int off, void *buf, int len);
+void link_health_sample(device_t *dev, link_health_t *h, int clear);
+int link_health_delta(const link_health_t *before, const link_health_t *after,
+	char *out, int len);
+void link_health_column(const link_health_t *before, const link_health_t *after,
+	char *out, int len);
+void link_health_step(device_t *dev, link_health_t *prev, const char *label);
+int link_health_cmd(device_t *dev, char *cmd);
+/* Profiled stages of the DMA paths */
+typedef enum {
+	PROF_ITERATION,            /* one speed change + descriptor test */
+	PROF_SETPCI,               /* setpci speed change */
+	PROF_DESC_REWRITE,         /* update desc[] for the next size */
+	PROF_DESC_COPY,            /* memset/memcpy of desc[] to boot_buffer */
+	PROF_PATTERN,              /* source regeneration, destination clear */
+	PROF_DOORBELL,             /* LLP and doorbell writes */
+	PROF_SPIN,                 /* DMA status busy wait */
+	PROF_VERIFY,               /* destination check */
+	PROF_PHASES
+} prof_phase_t;
+
+uint64_t prof_begin(void);
+void prof_end(int phase, uint64_t start);
+void prof_stop(void);
+int prof_command(device_t *dev, char *cmd);
+/* One iATU region */
+typedef struct {
+	int      inbound;
+	int      index;
+	int      enable;
+	uint32_t ctrl1;            /* region type etc. */
+	uint64_t base;
+	uint32_t limit;
+	uint64_t target;
+} atu_window_t;
+
+int atu_program(device_t *dev, const atu_window_t *win, int count);
+int atu_command(device_t *dev, char *cmd);
+/* Width and endian specialized fill/read kernels */
+typedef struct {
+	void (*fill)(device_t *dev, unsigned int addr, uint32_t count,
+		uint64_t val, uint32_t inc);
+	void (*read)(device_t *dev, unsigned int addr, void *buf, uint32_t count);
+	void (*write)(device_t *dev, unsigned int addr, const void *buf, uint32_t count);
+} mmio_kernel_t;
+
+const mmio_kernel_t *mmio_kernel_select(int width);
+int daemon_serve(device_t *dev, const char *path);
+int record_session(device_t *dev, char *cmd);
+int replay_session(device_t *dev, char *cmd);
+int rec_start(device_t *dev, const char *path);
+void rec_stop(void);
+void rec_access(int type, int width, unsigned int addr, uint64_t value);
+void rec_data(int type, int width, unsigned int addr, const void *data, uint32_t len);
+int run_setpci(const char *cmdline);
+/* Background jobs and DMA channel ownership */
+#define DMA_CHAN_WR         1
+#define DMA_CHAN_RD         2
+#define DMA_CHAN_BOTH       (DMA_CHAN_WR | DMA_CHAN_RD)
+
+int dma_claim(int chans, int wait);
+void dma_release(int chans);
+int job_stopping(void);
+int job_active(void);
+int job_others_running(void);
+void job_count(uint64_t iterations, uint64_t bytes, uint64_t errors);
+void job_note(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void job_notify(void);
+void job_shutdown(void);
+int job_start(device_t *dev, char *cmd);
+int job_list(device_t *dev, char *cmd);
+int job_stop(device_t *dev, char *cmd);
+int job_stats(device_t *dev, char *cmd);
+int watch_mem(device_t *dev, char *cmd);
 void pcie_mem_enable(void);
 
 /* Endian read/write mode */
 static int big_endian = 0;
 
+/* Phase profiling ("prof") */
+static int prof_enabled = 0;
+
+/* Session recording, NULL when not recording */
+static FILE *rec_fp = NULL;
+
+/* Session log entry types */
+enum {
+	REC_CMD = 1,               /* command line, text follows */
+	REC_SETPCI,                /* setpci command, text follows */
+	REC_WRITE,                 /* single write */
+	REC_READ,                  /* single read (count repeats) */
+	REC_WRITE_BLOCK,           /* block write, data follows */
+	REC_READ_BLOCK             /* block read, data follows */
+};
+
+/* Dump output format */
+static dump_opts_t dump_opts = { 4, 0, 1, DUMP_ADDR_BUS };
+
+/* Source pattern used by the '2' test and the ring */
+static pattern_t src_pattern = { PAT_PRBS31, 1, 1 };
+
+/* Worker placement relative to the device's NUMA node */
+typedef struct {
+	int        node;           /* device NUMA node, -1 if unknown */
+	int        strict;         /* remote udmabuf0 is fatal (-n) */
+	char      *cpulist;        /* -c override, NULL for local_cpulist */
+	char       cpustr[256];    /* CPU list actually used */
+	cpu_set_t  cpus;
+	int        ncpus;
+} placement_t;
+
+static placement_t placement = { .node = -1 };
+
 /* Low-level access functions */
 static void
 write_8(
@@ -100,33 +328,18 @@ write_8(
 	unsigned int  addr,
 	unsigned char data);
 
-static unsigned char
-read_8(
-	device_t    *dev,
-	unsigned int addr);
-
 static void
 write_le16(
 	device_t          *dev,
 	unsigned int       addr,
 	unsigned short int data);
 
-static unsigned short int
-read_le16(
-	device_t    *dev,
-	unsigned int addr);
-
 static void
 write_be16(
 	device_t          *dev,
 	unsigned int       addr,
 	unsigned short int data);
 
-static unsigned short int
-read_be16(
-	device_t    *dev,
-	unsigned int addr);
-
 static void
 write_le32(
 	device_t    *dev,
@@ -139,15 +352,16 @@ read_le32(
 	unsigned int addr);
 
 static void
-write_be32(
+store_le32(
 	device_t    *dev,
 	unsigned int addr,
 	unsigned int data);
 
-static unsigned int
-read_be32(
+static void
+write_be32(
 	device_t    *dev,
-	unsigned int addr);
+	unsigned int addr,
+	unsigned int data);
 
 /* Usage */
 static void show_usage()
@@ -155,34 +369,27 @@ static void show_usage()
 	printf("\nUsage: pci_debug -s <device>\n"\
 		 "  -h            Help (this message)\n"\
 		 "  -s <device>   Slot/device (as per lspci)\n" \
-		 "  -b <BAR>      Base address region (BAR) to access, eg. 0 for BAR0\n\n");
+		 "  -b <BAR>      Base address region (BAR) to access, eg. 0 for BAR0\n"\
+		 "  -c <cpulist>  CPUs for polling/verify threads (default: device local_cpulist)\n"\
+		 "  -n            Fail instead of warn when udmabuf0 is on a remote NUMA node\n"\
+		 "  -D <socket>   Run as a daemon serving commands on a Unix socket\n"\
+		 "  -e <cmds>     Run ';'-separated commands and exit\n"\
+		 "  -R <file>     Record the session (see 'record')\n\n");
+}
+
+/* Monotonic time in nanoseconds */
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
 }
 void mem_disp(void *mem_addr, uint32_t data_size)
 {
-    uint32_t columns, rows;
-    uint32_t column_cnt, row_cnt;
-    uint32_t *ptr = NULL;
-    column_cnt = 8;
-    row_cnt = data_size / column_cnt / 4;
-    if (column_cnt == 16)
-        printf("<--addr---dword-->: 03----00 07----04 11----08 15----12 19----16 23----20 27----24 31----28 "
-                 "35----32 39----36 43----40 47----44 51----48 55----52 59----56 63----60\n");
-    else
+    if ((dump_opts.group == 4) && (dump_opts.addr_mode != DUMP_ADDR_OFFSET) && !dump_opts.ascii)
         printf("<--addr---dword-->: 03----00 07----04 11----08 15----12 19----16 23----20 27----24 31----28\n");
-
-    ptr = (uint32_t *)mem_addr;
-    for (rows = 0; rows < row_cnt; rows++)
-    {
-        // LOG_INFO("%p: ", mem_addr + rows * 4 * column_cnt);
-        printf("0x%016lx: ", (uint64_t)(mem_addr + rows * 4 * column_cnt));
-        // LOG_INFO("0x%-16lx: ", (qword_t)(+ rows * 4 * column_cnt));
-        for (columns = 0; columns < column_cnt; columns++)
-        {
-            printf("%08x ", ptr[columns]);
-        }
-        printf("\n");
-        ptr += column_cnt;
-    }
+    dump_buffer(mem_addr, data_size, 32);
 }
 void *boot_buffer;
 uint32_t ep_addr = 0x0603d000;
@@ -192,39 +399,59 @@ uint32_t desc_size = 0;
 uint32_t desc_data_size = 4;
 desc_info desc[40] = {0};
 uint32_t data_cnt = 0;
+uint32_t desc_iter = 1;
 unsigned long phys_addr;
-int main(int argc, char *argv[])
+
+/* Map udmabuf0 and build the descriptor chains. Register-only
+ * sessions never need this, so it runs on the first command that
+ * uses the DMA engine or the buffer.
+ */
+static int dma_setup(void)
 {
-	int opt;
-	char *slot = 0;
-	int status;
-	struct stat statbuf;
-	device_t device;
-	device_t *dev = &device;	
-	int fd = 0;
 	char attr[1024];
-	uint32_t cnt = 0;
+	int fd;
+
 	// system("setpci -s 1:0.0 4.b=6");
 	// system("setpci -s 1:0.0 5.b=0");
-	pcie_mem_enable();
+	/* Memory space and bus master only. This runs lazily, possibly
+	 * after 'x' or 'X' set INTx disable in 5.b, so leave 5.b alone.
+	 */
+	run_setpci("setpci -s 1:0.0 4.b=6");
 	/* Clear desc mem*/
-if ((fd = open("/dev/udmabuf0", O_RDWR)) != -1)
-    {
-        boot_buffer = mmap(NULL, 0x100000, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-        /* Do some read/write access to buf */
-        //mem_disp((void *)boot_buffer, 256);f
-        close(fd);
-    }
-    if ((fd = open("/sys/class/u-dma-buf/udmabuf0/phys_addr", O_RDONLY)) != -1)
-    {
-        read(fd, attr, 1024);
-        sscanf(attr, "%lx", &phys_addr);	
-		printf("phys_addr:0x%lx\n", phys_addr);
-        close(fd);
-    }
-	for(cnt = 0; cnt < 0x1900; cnt += 0x4) {
-		*(volatile uint32_t*)(boot_buffer + sizeof(desc) + cnt) = cnt;
+	if ((fd = open("/dev/udmabuf0", O_RDWR)) == -1) {
+		printf("Open failed for file '/dev/udmabuf0': errno %d, %s\n",
+			errno, strerror(errno));
+		return -1;
+	}
+	boot_buffer = mmap(NULL, BOOT_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (boot_buffer == MAP_FAILED) {
+		printf("udmabuf0 mmap failed: errno %d, %s\n", errno, strerror(errno));
+		boot_buffer = NULL;
+		return -1;
+	}
+	memset(attr, 0, sizeof(attr));
+	if (((fd = open("/sys/class/u-dma-buf/udmabuf0/phys_addr", O_RDONLY)) == -1) ||
+	    (read(fd, attr, sizeof(attr) - 1) <= 0) ||
+	    (sscanf(attr, "%lx", &phys_addr) != 1)) {
+		printf("Cannot read the udmabuf0 physical address\n");
+		if (fd != -1) {
+			close(fd);
+		}
+		munmap(boot_buffer, BOOT_BUFFER_SIZE);
+		boot_buffer = NULL;
+		return -1;
 	}
+	close(fd);
+	printf("phys_addr:0x%lx\n", phys_addr);
+	if (placement_check_buffer() < 0) {
+		munmap(boot_buffer, BOOT_BUFFER_SIZE);
+		boot_buffer = NULL;
+		return -1;
+	}
+	pattern_fill(&src_pattern, desc_iter, (boot_buffer + sizeof(desc)),
+			desc_data_size * 10, desc_data_size, 0);
+	memset((boot_buffer + 0x2000), 0xa5, desc_data_size * 10);
 	// for(cnt = 0; cnt < 0x900; cnt += 0x4) {
 	// 	*(volatile uint32_t*)(boot_buffer + 0x900 + sizeof(desc) + cnt) = cnt;
 	// }
@@ -276,17 +503,63 @@ if ((fd = open("/dev/udmabuf0", O_RDWR)) != -1)
 	desc[39].desc_ctrl.Stop = 1;
 
 	memcpy((void *)(boot_buffer), desc, sizeof(desc));
-	mem_disp((void *)(boot_buffer), 0x1000);
+	return 0;
+}
+
+/* dma_setup() once; background jobs may race the prompt to it */
+int dma_prepare(void)
+{
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	static int dma_ready = 0;
+	int status = 0;
+
+	pthread_mutex_lock(&lock);
+	if (!dma_ready) {
+		status = dma_setup();
+		dma_ready = (status == 0);
+	}
+	pthread_mutex_unlock(&lock);
+	return status;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	char *slot = 0;
+	int status;
+	struct stat statbuf;
+	device_t device;
+	device_t *dev = &device;	
+	char *daemon_path = NULL;
+	char *script = NULL;
+	char *record = NULL;
+	char *cmd;
+	uint64_t start = now_ns();
 
 	/* Clear the structure fields */
 	memset(dev, 0, sizeof(device_t));
 
-	while ((opt = getopt(argc, argv, "b:hs:")) != -1) {
+	while ((opt = getopt(argc, argv, "b:c:D:e:hnR:s:")) != -1) {
 		switch (opt) {
 			case 'b':
 				/* Defaults to BAR0 if not provided */
 				dev->bar = atoi(optarg);
 				break;
+			case 'c':
+				placement.cpulist = optarg;
+				break;
+			case 'n':
+				placement.strict = 1;
+				break;
+			case 'D':
+				daemon_path = optarg;
+				break;
+			case 'e':
+				script = optarg;
+				break;
+			case 'R':
+				record = optarg;
+				break;
 			case 'h':
 				show_usage();
 				return -1;
@@ -317,6 +590,11 @@ if ((fd = open("/dev/udmabuf0", O_RDWR)) != -1)
 		return -1;
 	}
 
+	/* Keep polling and verification on the device's NUMA node */
+	if (placement_setup(dev) < 0) {
+		return -1;
+	}
+
 	/* Convert to a sysfs resource filename and open the resource */
 	snprintf(dev->filename, 99, "/sys/bus/pci/devices/%04x:%02x:%02x.%1x/resource%d",
 			dev->domain, dev->bus, dev->slot, dev->function, dev->bar);
@@ -392,18 +670,54 @@ if ((fd = open("/dev/udmabuf0", O_RDWR)) != -1)
 	 * ------------------------------------------------------------
 	 */
 
-	printf("\n");
-	printf("PCI debug\n");
-	printf("---------\n\n");
-	printf(" - accessing BAR%d\n", dev->bar);
-	printf(" - region size is %d-bytes\n", dev->size);
-	printf(" - offset into region is %d-bytes\n", dev->offset);
+	if (script == NULL) {
+		printf("\n");
+		printf("PCI debug\n");
+		printf("---------\n\n");
+		printf(" - accessing BAR%d\n", dev->bar);
+		printf(" - region size is %d-bytes\n", dev->size);
+		printf(" - offset into region is %d-bytes\n", dev->offset);
+		printf(" - NUMA node %d, worker CPUs %s\n", placement.node, placement.cpustr);
+		printf(" - startup took %.3f ms\n", (now_ns() - start) / 1e6);
+	}
+
+	if ((record != NULL) && (rec_start(dev, record) < 0)) {
+		return -1;
+	}
+
+	if (script != NULL) {
+		/* Scripted session: no banner, no prompt */
+		for (cmd = strtok(script, ";"); cmd != NULL; cmd = strtok(NULL, ";")) {
+			cmd += strspn(cmd, " \t");
+			if (process_command(dev, cmd) < 0) {
+				break;
+			}
+		}
+		job_shutdown();
+		prof_stop();
+		rec_stop();
+		fflush(stdout);
+		munmap(dev->maddr, dev->size);
+		close(dev->fd);
+		return 0;
+	}
+
+	if (daemon_path != NULL) {
+		/* Serve clients until killed */
+		status = daemon_serve(dev, daemon_path);
+		munmap(dev->maddr, dev->size);
+		close(dev->fd);
+		return status;
+	}
 
 	/* Display help */
 	display_help(dev);
 
 	/* Process commands */
 	parse_command(dev);
+	job_shutdown();
+	prof_stop();
+	rec_stop();
 
 	/* Cleanly shutdown */
 	munmap(dev->maddr, dev->size);
@@ -420,6 +734,7 @@ parse_command(
 	int status;
 
 	while(1) {
+		job_notify();
 		line = readline("PCI> ");
 		/* Ctrl-D check */
 		if (line == NULL) {
@@ -459,6 +774,7 @@ display_help(
 	printf("                              8   - 8-bit access\n");
 	printf("                              16  - 16-bit access\n");
 	printf("                              32  - 32-bit access (default)\n");
+	printf("                              64  - 64-bit access\n");
 	printf("  c[width] addr val         Change memory at addr to val\n");
 	printf("  e                         Print the endian access mode\n");
 	printf("  e[mode]                   Change the endian access mode\n");
@@ -470,6 +786,57 @@ display_help(
 	printf("                              val  - start value\n");
 	printf("                              len  - length (in bytes)\n");
 	printf("                              inc  - increment (defaults to 1)\n");
+	printf("  ring [slots] [size] [secs] Stream DMA over a recycled descriptor ring\n");
+	printf("                              slots - ring depth (decimal, default 16)\n");
+	printf("                              size  - bytes per slot (default 1000)\n");
+	printf("                              secs  - run time (decimal, default 5,\n");
+	printf("                                      0 = until stopped)\n");
+	printf("                             Overwrites slots * size bytes of endpoint\n");
+	printf("                             memory at ep_addr\n");
+	printf("  pio-bench addr [min] [max] [ep]  PIO vs. DMA throughput and crossover size\n");
+	printf("                              addr - scratch BAR window (overwritten)\n");
+	printf("                              min  - first size (default 4)\n");
+	printf("                              max  - last size (default 10000)\n");
+	printf("                              ep   - endpoint scratch address for DMA\n");
+	printf("                                     (overwritten, default ep_addr)\n");
+	printf("  snap [name addr len]       Capture a BAR window (no args: list)\n");
+	printf("  diff nameA [nameB]         Show words changed between snapshots,\n");
+	printf("                             or between nameA and the live BAR\n");
+	printf("  find where addr len w val [mask]  Search for a value\n");
+	printf("  find where addr len s bytes       Search for a byte sequence\n");
+	printf("                              where - bar or buf (udmabuf0)\n");
+	printf("                              w     - value width: 1, 2, 4 or 8 bytes\n");
+	printf("                              bytes - hex string, eg. deadbeef0102\n");
+	printf("  pat [name] [seed] [notag]  Show or select the DMA source pattern\n");
+	printf("                              name - addr, prbs7, prbs15, prbs31 (default),\n");
+	printf("                                     walk1, walk0, random\n");
+	printf("  dbuf addr len              Display udmabuf0 starting from offset addr\n");
+	printf("  dumpfmt [key val]...       Show or change the dump format\n");
+	printf("                              group   - 1, 2, 4 or 8 bytes (dbuf)\n");
+	printf("                              ascii   - on or off\n");
+	printf("                              squeeze - on or off (collapse repeats)\n");
+	printf("                              addr    - off, bus or virt (dbuf)\n");
+	printf("  record file | stop         Log commands and MMIO accesses to file\n");
+	printf("  replay file [fast] [verify]  Re-issue a recorded session\n");
+	printf("                              fast   - ignore the recorded timing\n");
+	printf("                              verify - compare reads with the recording\n");
+	printf("  bg command                 Run a command as a background job\n");
+	printf("  jobs                       List background jobs\n");
+	printf("  stop id | all              Stop a background job\n");
+	printf("  stats [id]                 Live job counters (rate since last stats)\n");
+	printf("  watch addr [ms] [count]    Report changes of a 32-bit register\n");
+	printf("                              ms    - poll interval (decimal, default 100)\n");
+	printf("                              count - samples (decimal, 0 = until stopped)\n");
+	printf("  aer [clear]                AER counters and PCIe error status of the\n");
+	printf("                             endpoint and its upstream port\n");
+	printf("  prof [on|off|reset|show]   Time the phases of the DMA paths\n");
+	printf("  prof trace file | stop     Also record spans as Chrome trace JSON\n");
+	printf("  atu [list]                 Show the window table and programmed regions\n");
+	printf("  atu set dir idx base limit target [ctrl1]  Add a window to the table\n");
+	printf("  atu set dir idx off        Add a disabled region to the table\n");
+	printf("                              dir - in or out, idx - region (decimal)\n");
+	printf("  atu load file              Replace the table with lines of 'set' arguments\n");
+	printf("  atu apply | clear          Program and verify the table, or empty it\n");
 	printf("  q                          Quit\n");
 	printf("\n  Notes:\n");
 	printf("    1. addr, len, and val are interpreted as hex values\n");
@@ -478,14 +845,14 @@ display_help(
 }
 void pcie_mem_enable(void)
 {
-	system("setpci -s 1:0.0 4.b=6");
-	system("setpci -s 1:0.0 5.b=0");
+	run_setpci("setpci -s 1:0.0 4.b=6");
+	run_setpci("setpci -s 1:0.0 5.b=0");
 }
 void pcie_link_down(void)
 {
-	system("setpci -s 0:1.0 3e.b=40:40");
+	run_setpci("setpci -s 0:1.0 3e.b=40:40");
 	usleep(50000);
-	system("setpci -s 0:1.0 3e.b=0:40");
+	run_setpci("setpci -s 0:1.0 3e.b=0:40");
 	usleep(50000);
 	pcie_mem_enable();
 	printf("link down pass\n");
@@ -493,33 +860,53 @@ void pcie_link_down(void)
 }
 void pcie_speed_change_gen1(void)
 {
-	system("setpci -s 0:1.0 70.b=1");
-	system("setpci -s 0:1.0 50.b=60");			
+	run_setpci("setpci -s 0:1.0 70.b=1");
+	run_setpci("setpci -s 0:1.0 50.b=60");			
 }
 void pcie_speed_change_gen2(void)
 {
-	system("setpci -s 0:1.0 70.b=2");
-	system("setpci -s 0:1.0 50.b=60");			
+	run_setpci("setpci -s 0:1.0 70.b=2");
+	run_setpci("setpci -s 0:1.0 50.b=60");			
 }
 void desc_speed_reset_mix_case(device_t *dev)
 {
-	uint32_t i = 0;
+	int i = 0;
+	uint64_t t;
+
+	t = prof_begin();
 	write_le32(dev, 0x34, 0x1100000);
 	write_le32(dev, 0x2c, 10);
+	prof_end(PROF_DOORBELL, t);
+	t = prof_begin();
 	while(0x40 == (read_le32(dev, 0x44) & 0x40));
+	prof_end(PROF_SPIN, t);
 
+	t = prof_begin();
 	write_le32(dev, 0x1c, 0x11001e0);
 	write_le32(dev, 0x14, 10);
+	prof_end(PROF_DOORBELL, t);
+	t = prof_begin();
 	while(0x10 == (read_le32(dev, 0x44) & 0x10));
+	prof_end(PROF_SPIN, t);
 
-	i = memcmp((boot_buffer + sizeof(desc)), (boot_buffer + 0x2000), desc_data_size * 10);
-	if(0 == i) {
-		printf("desc pass \n");
+	/* Regenerate the expected data rather than trusting the source */
+	t = prof_begin();
+	i = pattern_check(&src_pattern, desc_iter, (boot_buffer + 0x2000),
+			desc_data_size * 10, desc_data_size, 0);
+	prof_end(PROF_VERIFY, t);
+	job_count(1, desc_data_size * 10 * 2, i >= 0);
+	job_note("iteration %u, size %#x", desc_iter, desc_data_size);
+	if(i < 0) {
+		if (!job_active()) {
+			printf("desc pass \n");
+		}
 	} else {
+		printf("desc fail at offset %#x (iteration %u)\n", i, desc_iter);
 		mem_disp((void *)(boot_buffer+0x2000), desc_data_size * 10);
 		mem_disp((void *)(boot_buffer+sizeof(desc)), desc_data_size * 10);
 		//access(0,0);
 	}	
+	t = prof_begin();
 	desc_data_size += 4;
 	if(desc_data_size > 128) {
 		desc_data_size = 4;
@@ -537,19 +924,80 @@ void desc_speed_reset_mix_case(device_t *dev)
 		desc[desc_size+1].DAR_Low = (phys_addr + 0x2000) + (data_cnt * desc_data_size);
 		desc[desc_size+1].SAR_Low = ep_addr + (data_cnt++ * desc_data_size);
 	}
+	prof_end(PROF_DESC_REWRITE, t);
+	t = prof_begin();
 	memset((boot_buffer), 0, sizeof(desc));
 	memcpy((void *)(boot_buffer), desc, sizeof(desc));
-	printf("desc size : %#x\n", desc_data_size);
+	prof_end(PROF_DESC_COPY, t);
+	if (!job_active()) {
+		printf("desc size : %#x\n", desc_data_size);
+	}
 	//mem_disp((void *)(boot_buffer), sizeof(desc));
 
-	memset((boot_buffer + 0x2000), 0, desc_data_size);
+	/* Fresh, iteration-tagged source data */
+	desc_iter++;
+	t = prof_begin();
+	pattern_fill(&src_pattern, desc_iter, (boot_buffer + sizeof(desc)),
+			desc_data_size * 10, desc_data_size, 0);
+	/* Poison: a transfer that never happened must not pass */
+	memset((boot_buffer + 0x2000), 0xa5, desc_data_size * 10);
+	prof_end(PROF_PATTERN, t);
 
 }
+/* Inbound window used by 'i': BAR0 -> DMA engine registers */
+static const atu_window_t atu_dma_window = {
+	1, 0, 1, 0x0, 0xa3000000, 0xa3010000, 0x10d80000
+};
+
+/* Multi-character commands, matched against the first word of the
+ * line before falling back to the single character commands.
+ */
+typedef struct {
+	const char *name;
+	int (*handler)(device_t *dev, char *cmd);
+} named_command_t;
+
+static named_command_t named_commands[] = {
+	{"ring", ring_stream},
+	{"pio-bench", pio_bench},
+	{"snap", snap_mem},
+	{"diff", diff_mem},
+	{"find", find_mem},
+	{"pat", pattern_select},
+	{"dbuf", dump_buffer_cmd},
+	{"dumpfmt", dump_format},
+	{"record", record_session},
+	{"replay", replay_session},
+	{"bg", job_start},
+	{"jobs", job_list},
+	{"stop", job_stop},
+	{"stats", job_stats},
+	{"watch", watch_mem},
+	{"aer", link_health_cmd},
+	{"prof", prof_command},
+	{"atu", atu_command},
+	{NULL, NULL}
+};
+
 int process_command(device_t *dev, char *cmd)
 {
+	named_command_t *nc;
+	link_health_t link;
+	uint64_t t;
+	size_t len;
+
 	if (cmd[0] == '\0') {
 		return 0;
 	}
+	if (rec_fp != NULL) {
+		rec_data(REC_CMD, 0, 0, cmd, strlen(cmd));
+	}
+	len = strcspn(cmd, " \t");
+	for (nc = named_commands; nc->name != NULL; nc++) {
+		if ((strlen(nc->name) == len) && (strncmp(cmd, nc->name, len) == 0)) {
+			return nc->handler(dev, cmd);
+		}
+	}
 	switch (cmd[0]) {
 		case '?':
 			display_help(dev);
@@ -568,25 +1016,27 @@ int process_command(device_t *dev, char *cmd)
 			return fill_mem(dev, cmd);
 		case 'q':
 		case 'Q':
-			mem_disp((void *)(boot_buffer+0x2000), 0x500);
-			mem_disp((void *)(boot_buffer), 0x500);
+			if (boot_buffer != NULL) {
+				mem_disp((void *)(boot_buffer+0x2000), 0x500);
+				mem_disp((void *)(boot_buffer), 0x500);
+			}
 			return 1;
 		case 'l':
 		case 'L': 
-			system("setpci -s 1:0.0 5.b=0");
-			system("setpci -s 1:0.0 b3.b=0");
-			system("setpci -s 1:0.0 52.b=0:1");
+			run_setpci("setpci -s 1:0.0 5.b=0");
+			run_setpci("setpci -s 1:0.0 b3.b=0");
+			run_setpci("setpci -s 1:0.0 52.b=0:1");
 			printf("legacy int init\n");
 			return 1;
 		case 'x':
-			system("setpci -s 1:0.0 5.b=04"); 	
-			system("setpci -s 1:0.0 b3.b=0");
-			system("setpci -s 1:0.0 52.b=1:1");
+			run_setpci("setpci -s 1:0.0 5.b=04"); 	
+			run_setpci("setpci -s 1:0.0 b3.b=0");
+			run_setpci("setpci -s 1:0.0 52.b=1:1");
 			printf("msi int init\n");
 			return 1;
 		case 'X':
-			system("setpci -s 1:0.0 5.b=04");
-			system("setpci -s 1:0.0 b3.b=80");
+			run_setpci("setpci -s 1:0.0 5.b=04");
+			run_setpci("setpci -s 1:0.0 b3.b=80");
 			printf("msix int init\n");
 			return 1;
 		case 'a':
@@ -594,49 +1044,47 @@ int process_command(device_t *dev, char *cmd)
 			return 1;	
 		case 'i':
 			printf("bar0 aut init dma reg -> bar0\n");
-			system("setpci -s 1:0.0 81c.b=0:1");
-			usleep(50);
-			system("setpci -s 1:0.0 81c.b=0:1");
-			printf("enable AUT\n");
-			usleep(1000);
-			write_le32(dev, 0x108, 0xa3000000);
-			write_le32(dev, 0x110, 0xa3010000);
-			write_le32(dev, 0x114, 0x10d80000);
-			write_le32(dev, 0x100, 0x0);
-			write_le32(dev, 0x104, 0x80000000);
-
-			printf("inbound base addr: %#x\n", read_le32(dev, 0x108));
-			printf("inbound limit addr: %#x\n", read_le32(dev, 0x110));
-			printf("inbound target addr: %#x\n", read_le32(dev, 0x114));
-			printf("inbound ctrl 1: %#x\n", read_le32(dev, 0x0));
-			printf("inbound ctrl 2: %#x\n", read_le32(dev, 0x104));
-
-			usleep(1000);
-			system("setpci -s 1:0.0 81c.b=1:1");
-			usleep(50);
-			system("setpci -s 1:0.0 81c.b=1:1");
-			usleep(1000);
-			printf("disable AUT\n");
+			if (atu_program(dev, &atu_dma_window, 1) != 0) {
+				return 0;
+			}
 			write_le32(dev, 0x0, 0x0);
 			write_le32(dev, 0x8, 0x1);
 			printf("dma init done\n");
 			return 1;
 
 		case '1':	//pre-fetch
+			if ((dma_prepare() < 0) || (dma_claim(DMA_CHAN_BOTH, 0) < 0)) {
+				return 0;
+			}
 			write_le32(dev, 0xc, 0x1100000);
 			write_le32(dev, 0x14, 0x1100030);
 			write_le32(dev, 0x4, 1);
 			write_le32(dev, 0x8, 1);
+			dma_release(DMA_CHAN_BOTH);
 			return 1;
 
 		case '2':
-			while(1){
+			if ((dma_prepare() < 0) || (dma_claim(DMA_CHAN_BOTH, 0) < 0)) {
+				return 0;
+			}
+			/* Runs forever at the prompt; use "bg 2" to keep it stoppable */
+			link_health_sample(dev, &link, 1);
+			while(!job_stopping()){
+				t = prof_begin();
 				pcie_speed_change_gen1();				
+				prof_end(PROF_SETPCI, t);
 				desc_speed_reset_mix_case(dev);
+				prof_end(PROF_ITERATION, t);
+				link_health_step(dev, &link, "gen1");
+				t = prof_begin();
 				pcie_speed_change_gen2();
+				prof_end(PROF_SETPCI, t);
 				desc_speed_reset_mix_case(dev);
+				prof_end(PROF_ITERATION, t);
+				link_health_step(dev, &link, "gen2");
 				//pcie_link_down();
 			}
+			dma_release(DMA_CHAN_BOTH);
 			return 1;
 		case '4':
 			return 1;
@@ -652,12 +1100,10 @@ int display_mem(device_t *dev, char *cmd)
 	int addr = 0;
 	int len = 0;
 	int status;
-	int i;
-	unsigned char d8;
-	unsigned short d16;
-	unsigned int d32;
+	unsigned char *buf;
+	const mmio_kernel_t *kernel;
 
-	/* d, d8, d16, d32 */
+	/* d, d8, d16, d32, d64 */
 	if (cmd[1] == ' ') {
 		status = sscanf(cmd, "%*c %x %x", &addr, &len);
 		if (status != 2) {
@@ -680,53 +1126,26 @@ int display_mem(device_t *dev, char *cmd)
 	/* Length is in bytes */
 	if ((addr + len) > dev->size) {
 		/* Truncate */
-		len = dev->size;
+		len = dev->size - addr;
 	}
-	switch (width) {
-		case 8:
-			for (i = 0; i < len; i++) {
-				if ((i%16) == 0) {
-					printf("\n%.8X: ", addr+i);
-				}
-				d8 = read_8(dev, addr+i);
-				printf("%.2X ", d8);
-			}
-			printf("\n");
-			break;
-		case 16:
-			for (i = 0; i < len; i+=2) {
-				if ((i%16) == 0) {
-					printf("\n%.8X: ", addr+i);
-				}
-				if (big_endian == 0) {
-					d16 = read_le16(dev, addr+i);
-				} else {
-					d16 = read_be16(dev, addr+i);
-				}
-				printf("%.4X ", d16);
-			}
-			printf("\n");
-			break;
-		case 32:
-			for (i = 0; i < len; i+=4) {
-				if ((i%16) == 0) {
-					printf("\n%.8X: ", addr+i);
-				}
-				if (big_endian == 0) {
-					d32 = read_le32(dev, addr+i);
-				} else {
-					d32 = read_be32(dev, addr+i);
-				}
-				printf("%.8X ", d32);
-			}
-			printf("\n");
-			break;
-		default:
-			printf("Syntax error (use ? for help)\n");
-			/* Don't break out of command processing loop */
-			break;
+	kernel = mmio_kernel_select(width);
+	if (kernel == NULL) {
+		printf("Syntax error (use ? for help)\n");
+		/* Don't break out of command processing loop */
+		return 0;
+	}
+
+	/* Read the window into host memory, then format it in one pass */
+	buf = malloc(len + 8);
+	if (buf == NULL) {
+		printf("Error: cannot allocate %#x bytes\n", len);
+		return 0;
 	}
+	kernel->read(dev, addr, buf, len / (width / 8));
 	printf("\n");
+	dump_data(buf, len - (len % (width / 8)), addr, 8, 16, width / 8);
+	printf("\n");
+	free(buf);
 	return 0;
 }
 
@@ -787,6 +1206,9 @@ int change_mem(device_t *dev, char *cmd)
 	return 0;
 }
 
+/* Elements per fill chunk */
+#define FILL_CHUNK          0x10000
+
 int fill_mem(device_t *dev, char *cmd)
 {
 	int width = 32;
@@ -794,14 +1216,13 @@ int fill_mem(device_t *dev, char *cmd)
 	int len = 0;
 	int inc = 0;
 	int status;
-	int i;
-	unsigned char d8;
-	unsigned short d16;
-	unsigned int d32;
+	unsigned long long val;
+	uint32_t count, done, n;
+	const mmio_kernel_t *kernel;
 
-	/* c, c8, c16, c32 */
+	/* f, f8, f16, f32, f64 */
 	if (cmd[1] == ' ') {
-		status = sscanf(cmd, "%*c %x %x %x %x", &addr, &d32, &len, &inc);
+		status = sscanf(cmd, "%*c %x %llx %x %x", &addr, &val, &len, &inc);
 		if ((status != 3) && (status != 4)) {
 			printf("Syntax error (use ? for help)\n");
 			/* Don't break out of command processing loop */
@@ -811,8 +1232,8 @@ int fill_mem(device_t *dev, char *cmd)
 			inc = 1;
 		}
 	} else {
-		status = sscanf(cmd, "%*c%d %x %x %x %x", &width, &addr, &d32, &len, &inc);
-		if ((status != 3) && (status != 4)) {
+		status = sscanf(cmd, "%*c%d %x %llx %x %x", &width, &addr, &val, &len, &inc);
+		if ((status != 4) && (status != 5)) {
 			printf("Syntax error (use ? for help)\n");
 			/* Don't break out of command processing loop */
 			return 0;
@@ -828,38 +1249,21 @@ int fill_mem(device_t *dev, char *cmd)
 	/* Length is in bytes */
 	if ((addr + len) > dev->size) {
 		/* Truncate */
-		len = dev->size;
+		len = dev->size - addr;
 	}
-	switch (width) {
-		case 8:
-			for (i = 0; i < len; i++) {
-				d8 = (unsigned char)(d32 + i*inc);
-				write_8(dev, addr+i, d8);
-			}
-			break;
-		case 16:
-			for (i = 0; i < len/2; i++) {
-				d16 = (unsigned short)(d32 + i*inc);
-				if (big_endian == 0) {
-					write_le16(dev, addr+2*i, d16);
-				} else {
-					write_be16(dev, addr+2*i, d16);
-				}
-			}
-			break;
-		case 32:
-			for (i = 0; i < len/4; i++) {
-				if (big_endian == 0) {
-					write_le32(dev, addr+4*i, d32 + i*inc);
-				} else {
-					write_be32(dev, addr+4*i, d32 + i*inc);
-				}
-			}
-			break;
-		default:
-			printf("Syntax error (use ? for help)\n");
-			/* Don't break out of command processing loop */
-			break;
+	kernel = mmio_kernel_select(width);
+	if (kernel == NULL) {
+		printf("Syntax error (use ? for help)\n");
+		/* Don't break out of command processing loop */
+		return 0;
+	}
+	count = len / (width / 8);
+	/* Chunked so a background fill can be stopped */
+	for (done = 0; (done < count) && !job_stopping(); done += n) {
+		n = (count - done < FILL_CHUNK) ? count - done : FILL_CHUNK;
+		kernel->fill(dev, addr + done * (width / 8), n,
+			val + (uint64_t)done * inc, inc);
+		job_count(1, n * (width / 8), 0);
 	}
 	return 0;
 }
@@ -900,78 +1304,4429 @@ int change_endian(device_t *dev, char *cmd)
 }
 
 /* ----------------------------------------------------------------
- * Raw pointer read/write access
+ * Memory dump formatting
  * ----------------------------------------------------------------
+ *
+ * Lines are rendered from a byte-to-hex lookup table into a large
+ * output buffer that is written to stdout in one go, instead of one
+ * printf() per word. Groups of 2/4/8 bytes are shown as little-endian
+ * values (most significant byte first), matching the values returned
+ * by the read accessors. Background jobs dump too (a '2' failure,
+ * 'bg d'), so a whole dump is rendered and written under dump_lock.
  */
-static void
-write_8(
-	device_t      *dev,
-	unsigned int   addr,
-	unsigned char  data)
-{
-	*(volatile unsigned char *)(dev->addr + addr) = data;
-	msync((void *)(dev->addr + addr), 1, MS_SYNC | MS_INVALIDATE);
-}
+#define DUMP_BUF_SIZE       0x40000
+#define DUMP_MAX_LINE       256
 
-static unsigned char
-read_8(
-	device_t      *dev,
-	unsigned int   addr)
-{
-	return *(volatile unsigned char *)(dev->addr + addr);
-}
+static const char *dump_addr_names[] = { "off", "bus", "virt" };
 
-static void
-write_le16(
-	device_t      *dev,
-	unsigned int   addr,
-	unsigned short int data)
+static char dump_hex[256][2];
+static char dump_buf[DUMP_BUF_SIZE];
+static uint32_t dump_used;
+static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Write out the buffer; called with dump_lock held */
+void dump_flush(void)
 {
-	if (__BYTE_ORDER != __LITTLE_ENDIAN) {
-		data = bswap_16(data);
+	uint32_t done = 0;
+	ssize_t n;
+
+	fflush(stdout);
+	while (done < dump_used) {
+		n = write(STDOUT_FILENO, dump_buf + done, dump_used - done);
+		if (n <= 0) {
+			if ((n < 0) && (errno == EINTR)) {
+				continue;
+			}
+			break;
+		}
+		done += n;
 	}
-	*(volatile unsigned short int *)(dev->addr + addr) = data;
-	msync((void *)(dev->addr + addr), 2, MS_SYNC | MS_INVALIDATE);
+	dump_used = 0;
 }
 
-static unsigned short int
-read_le16(
-	device_t      *dev,
-	unsigned int   addr)
+static void dump_puts(const char *str)
 {
-	unsigned int data = *(volatile unsigned short int *)(dev->addr + addr);
-	if (__BYTE_ORDER != __LITTLE_ENDIAN) {
-		data = bswap_16(data);
+	size_t len = strlen(str);
+
+	if (dump_used + len > DUMP_BUF_SIZE) {
+		dump_flush();
 	}
-	return data;
+	memcpy(dump_buf + dump_used, str, len);
+	dump_used += len;
 }
 
-static void
-write_be16(
-	device_t      *dev,
-	unsigned int   addr,
-	unsigned short int data)
+/* Render one line of line_bytes (or fewer at the end) into out */
+static char *dump_render(char *out, uint64_t label, int digits,
+	const unsigned char *p, uint32_t n, uint32_t line_bytes, int group)
 {
-	if (__BYTE_ORDER == __LITTLE_ENDIAN) {
-		data = bswap_16(data);
+	uint32_t i;
+	int b, d;
+
+	for (d = digits - 1; d >= 0; d--) {
+		*out++ = "0123456789ABCDEF"[(label >> (4 * d)) & 0xf];
 	}
-	*(volatile unsigned short int *)(dev->addr + addr) = data;
-	msync((void *)(dev->addr + addr), 2, MS_SYNC | MS_INVALIDATE);
+	*out++ = ':';
+	*out++ = ' ';
+	for (i = 0; i < line_bytes; i += group) {
+		if (i + group <= n) {
+			for (b = group - 1; b >= 0; b--) {
+				*out++ = dump_hex[p[i + b]][0];
+				*out++ = dump_hex[p[i + b]][1];
+			}
+		} else {
+			memset(out, ' ', 2 * group);
+			out += 2 * group;
+		}
+		*out++ = ' ';
+	}
+	if (dump_opts.ascii) {
+		*out++ = '|';
+		for (i = 0; i < n; i++) {
+			*out++ = ((p[i] >= 0x20) && (p[i] < 0x7f)) ? p[i] : '.';
+		}
+		*out++ = '|';
+	}
+	*out++ = '\n';
+	return out;
 }
 
-static unsigned short int
-read_be16(
-	device_t      *dev,
-	unsigned int   addr)
+/* Format len bytes of data. label is the address shown for the first
+ * byte; digits is the number of hex digits used for addresses.
+ */
+void dump_data(const void *data, uint32_t len, uint64_t label, int digits,
+	uint32_t line_bytes, int group)
 {
-	unsigned int data = *(volatile unsigned short int *)(dev->addr + addr);
-	if (__BYTE_ORDER == __LITTLE_ENDIAN) {
-		data = bswap_16(data);
+	const unsigned char *p = data;
+	const unsigned char *prev = NULL;
+	uint32_t off, n;
+	int squeezed = 0;
+	char *end;
+	int i;
+
+	pthread_mutex_lock(&dump_lock);
+	if (dump_hex[0][0] == 0) {
+		for (i = 0; i < 256; i++) {
+			dump_hex[i][0] = "0123456789ABCDEF"[i >> 4];
+			dump_hex[i][1] = "0123456789ABCDEF"[i & 0xf];
+		}
 	}
-	return data;
-}
+	fflush(stdout);
+	for (off = 0; off < len; off += line_bytes) {
+		n = (len - off < line_bytes) ? len - off : line_bytes;
 
-static void
+		/* Collapse runs of identical lines, but always show the last */
+		if (dump_opts.squeeze && (prev != NULL) && (n == line_bytes) &&
+		    (off + n < len) && (memcmp(prev, p + off, n) == 0)) {
+			if (!squeezed) {
+				dump_puts("*\n");
+				squeezed = 1;
+			}
+			continue;
+		}
+		squeezed = 0;
+		prev = p + off;
+
+		if (dump_used + DUMP_MAX_LINE + 4 * line_bytes > DUMP_BUF_SIZE) {
+			dump_flush();
+		}
+		end = dump_render(dump_buf + dump_used, label + off, digits,
+				p + off, n, line_bytes, group);
+		dump_used = end - dump_buf;
+	}
+	dump_flush();
+	pthread_mutex_unlock(&dump_lock);
+}
+
+/* Dump part of boot_buffer, labelled per the current address mode */
+void dump_buffer(const void *addr, uint32_t len, uint32_t line_bytes)
+{
+	uint64_t off = (const unsigned char *)addr - (const unsigned char *)boot_buffer;
+
+	switch (dump_opts.addr_mode) {
+		case DUMP_ADDR_BUS:
+			dump_data(addr, len, phys_addr + off, 16, line_bytes, dump_opts.group);
+			break;
+		case DUMP_ADDR_VIRT:
+			dump_data(addr, len, (uint64_t)(uintptr_t)addr, 16, line_bytes,
+				dump_opts.group);
+			break;
+		default:
+			dump_data(addr, len, off, 8, line_bytes, dump_opts.group);
+			break;
+	}
+}
+
+int dump_buffer_cmd(device_t *dev, char *cmd)
+{
+	unsigned int addr = 0;
+	unsigned int len = 0;
+	int status;
+
+	status = sscanf(cmd, "%*s %x %x", &addr, &len);
+	if (status != 2) {
+		printf("Syntax error (use ? for help)\n");
+		return 0;
+	}
+	if ((addr > BOOT_BUFFER_SIZE) || (len > BOOT_BUFFER_SIZE - addr)) {
+		printf("Error: invalid address (maximum allowed is %.8X\n", BOOT_BUFFER_SIZE);
+		return 0;
+	}
+	if (dma_prepare() < 0) {
+		return 0;
+	}
+	dump_buffer(boot_buffer + addr, len, 32);
+	return 0;
+}
+
+int dump_format(device_t *dev, char *cmd)
+{
+	char key[16], val[16];
+	char *p = cmd + strcspn(cmd, " \t");
+	int n;
+	unsigned int i;
+
+	while (sscanf(p, " %15s %15s%n", key, val, &n) == 2) {
+		p += n;
+		if (strcmp(key, "group") == 0) {
+			i = atoi(val);
+			if ((i == 1) || (i == 2) || (i == 4) || (i == 8)) {
+				dump_opts.group = i;
+				continue;
+			}
+		} else if (strcmp(key, "ascii") == 0) {
+			dump_opts.ascii = (strcmp(val, "on") == 0);
+			continue;
+		} else if (strcmp(key, "squeeze") == 0) {
+			dump_opts.squeeze = (strcmp(val, "on") == 0);
+			continue;
+		} else if (strcmp(key, "addr") == 0) {
+			for (i = 0; i < 3; i++) {
+				if (strcmp(val, dump_addr_names[i]) == 0) {
+					dump_opts.addr_mode = i;
+					break;
+				}
+			}
+			if (i < 3) {
+				continue;
+			}
+		}
+		printf("Syntax error (use ? for help)\n");
+		return 0;
+	}
+	printf("Dump format: group %d, ascii %s, squeeze %s, addr %s\n",
+		dump_opts.group, dump_opts.ascii ? "on" : "off",
+		dump_opts.squeeze ? "on" : "off", dump_addr_names[dump_opts.addr_mode]);
+	return 0;
+}
+
+/* ----------------------------------------------------------------
+ * Test patterns
+ * ----------------------------------------------------------------
+ *
+ * Source buffers are filled from a pattern generator and the checker
+ * regenerates the expected data rather than comparing against a
+ * golden copy. A buffer is split into segments (one per descriptor
+ * or ring slot); each segment restarts its generator from the seed,
+ * the iteration number and the segment index. With tagging on, every
+ * word is also XORed with a tag holding the segment index (high half)
+ * and the iteration number (low half), so a short segment still
+ * carries pattern data, and a segment from an earlier iteration or at
+ * the wrong offset never passes. Iterations start at 1 and callers
+ * poison the destination with a non-zero byte, so the tag is never 0
+ * and an untouched destination cannot pass.
+ *
+ * The PRBS generators are word-parallel LFSRs producing 6 (PRBS-7),
+ * 14 (PRBS-15) or 28 (PRBS-31) bits per step. Random data is a
+ * counter-based hash, computed eight words at a time with AVX2.
+ */
+#define PAT_CHUNK_WORDS     1024
+
+static const char *pattern_names[] = {
+	"addr", "prbs7", "prbs15", "prbs31", "walk1", "walk0", "random"
+};
+
+static uint32_t pattern_mix(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	x ^= x >> 16;
+	return x;
+}
+
+static void pattern_begin(pattern_gen_t *g, const pattern_t *pat, uint32_t iter,
+	uint32_t segment, uint32_t base)
+{
+	uint32_t order;
+
+	memset(g, 0, sizeof(*g));
+	g->pat = *pat;
+	g->iter = iter;
+	g->segment = segment;
+	g->base = base;
+	g->key = pattern_mix(pat->seed ^ pattern_mix(iter * 0x9e3779b9u ^ segment));
+
+	switch (pat->kind) {
+		case PAT_PRBS7:  order = 7;  g->shift = 1; break;
+		case PAT_PRBS15: order = 15; g->shift = 1; break;
+		default:         order = 31; g->shift = 3; break;
+	}
+	g->order = order;
+	g->lfsr = g->key & ((1u << order) - 1);
+	if (g->lfsr == 0) {
+		g->lfsr = 1;
+	}
+}
+
+/* Next 32 bits of the PRBS stream; bit 0 is the earliest bit */
+static uint32_t pattern_prbs_word(pattern_gen_t *g)
+{
+	uint32_t step = g->order - g->shift;
+	uint32_t bits;
+	uint32_t word;
+
+	while (g->nacc < 32) {
+		bits = (g->lfsr ^ (g->lfsr >> g->shift)) & ((1u << step) - 1);
+		g->lfsr = (g->lfsr >> step) | (bits << g->shift);
+		g->acc |= (uint64_t)bits << g->nacc;
+		g->nacc += step;
+	}
+	word = (uint32_t)g->acc;
+	g->acc >>= 32;
+	g->nacc -= 32;
+	return word;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static void pattern_random_avx2(uint32_t *buf, uint32_t first, uint32_t words, uint32_t key)
+{
+	__m256i idx = _mm256_add_epi32(_mm256_set1_epi32(first + key),
+		_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+	__m256i eight = _mm256_set1_epi32(8);
+	__m256i m1 = _mm256_set1_epi32(0x7feb352d);
+	__m256i m2 = _mm256_set1_epi32(0x846ca68b);
+	__m256i x;
+	uint32_t i;
+
+	for (i = 0; i + 8 <= words; i += 8) {
+		x = _mm256_xor_si256(idx, _mm256_srli_epi32(idx, 16));
+		x = _mm256_mullo_epi32(x, m1);
+		x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 15));
+		x = _mm256_mullo_epi32(x, m2);
+		x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+		_mm256_storeu_si256((__m256i *)&buf[i], x);
+		idx = _mm256_add_epi32(idx, eight);
+	}
+	for (; i < words; i++) {
+		buf[i] = pattern_mix(first + key + i);
+	}
+}
+#endif
+
+/* Produce the next words of the current segment */
+static void pattern_generate(pattern_gen_t *g, uint32_t *buf, uint32_t words)
+{
+	uint32_t first = g->word;
+	uint32_t tag;
+	uint32_t i;
+
+	switch (g->pat.kind) {
+		case PAT_ADDR:
+			for (i = 0; i < words; i++) {
+				buf[i] = g->base + 4 * (first + i);
+			}
+			break;
+		case PAT_WALK1:
+			for (i = 0; i < words; i++) {
+				buf[i] = 1u << ((first + i + g->iter) & 31);
+			}
+			break;
+		case PAT_WALK0:
+			for (i = 0; i < words; i++) {
+				buf[i] = ~(1u << ((first + i + g->iter) & 31));
+			}
+			break;
+		case PAT_RANDOM:
+#if defined(__x86_64__)
+			if (__builtin_cpu_supports("avx2")) {
+				pattern_random_avx2(buf, first, words, g->key);
+				break;
+			}
+#endif
+			for (i = 0; i < words; i++) {
+				buf[i] = pattern_mix(first + g->key + i);
+			}
+			break;
+		default:
+			for (i = 0; i < words; i++) {
+				buf[i] = pattern_prbs_word(g);
+			}
+			break;
+	}
+
+	/* Segment and iteration tag in every word */
+	if (g->pat.tag) {
+		tag = (g->segment << 16) | (g->iter & 0xffff);
+		for (i = 0; i < words; i++) {
+			buf[i] ^= tag;
+		}
+	}
+	g->word += words;
+}
+
+/* Fill len bytes as consecutive segments of seg bytes. base is the
+ * value of the first word for the address-as-data pattern.
+ */
+void pattern_fill(const pattern_t *pat, uint32_t iter, void *buf, uint32_t len,
+	uint32_t seg, uint32_t base)
+{
+	pattern_gen_t g;
+	uint32_t off, n;
+
+	for (off = 0; off < len; off += seg) {
+		n = (len - off < seg) ? len - off : seg;
+		pattern_begin(&g, pat, iter, off / seg, base + off);
+		pattern_generate(&g, (uint32_t *)(buf + off), n / 4);
+	}
+}
+
+/* Check a buffer written by pattern_fill(); returns the byte offset
+ * of the first mismatch, or -1 if the whole buffer matches.
+ */
+int pattern_check(const pattern_t *pat, uint32_t iter, const void *buf, uint32_t len,
+	uint32_t seg, uint32_t base)
+{
+	uint32_t expect[PAT_CHUNK_WORDS];
+	const uint32_t *data;
+	pattern_gen_t g;
+	uint32_t off, pos, n, words, i;
+
+	for (off = 0; off < len; off += seg) {
+		n = (len - off < seg) ? len - off : seg;
+		pattern_begin(&g, pat, iter, off / seg, base + off);
+		data = (const uint32_t *)(buf + off);
+		for (pos = 0; pos < n / 4; pos += words) {
+			words = n / 4 - pos;
+			if (words > PAT_CHUNK_WORDS) {
+				words = PAT_CHUNK_WORDS;
+			}
+			pattern_generate(&g, expect, words);
+			if (memcmp(expect, &data[pos], words * 4) != 0) {
+				for (i = 0; expect[i] == data[pos + i]; i++);
+				return off + 4 * (pos + i);
+			}
+		}
+	}
+	return -1;
+}
+
+int pattern_select(device_t *dev, char *cmd)
+{
+	char name[16], opt[16];
+	unsigned int seed = src_pattern.seed;
+	unsigned int i;
+	int tag = 1, seeded = 0;
+	char *end;
+	int n = 0;
+
+	if (sscanf(cmd, "%*s %15s%n", name, &n) < 1) {
+		printf("Pattern: %s, seed %x, tags %s\n", pattern_names[src_pattern.kind],
+			src_pattern.seed, src_pattern.tag ? "on" : "off");
+		return 0;
+	}
+	for (i = 0; i < sizeof(pattern_names) / sizeof(pattern_names[0]); i++) {
+		if (strcmp(name, pattern_names[i]) == 0) {
+			break;
+		}
+	}
+	if (i == sizeof(pattern_names) / sizeof(pattern_names[0])) {
+		printf("Syntax error (use ? for help)\n");
+		return 0;
+	}
+	/* The seed and notag are each optional, in either order */
+	cmd += n;
+	while (sscanf(cmd, "%15s%n", opt, &n) == 1) {
+		cmd += n;
+		if (strcmp(opt, "notag") == 0) {
+			tag = 0;
+			continue;
+		}
+		seed = strtoul(opt, &end, 16);
+		if (seeded++ || (*end != '\0')) {
+			printf("Syntax error (use ? for help)\n");
+			return 0;
+		}
+	}
+	src_pattern.kind = i;
+	src_pattern.seed = seed;
+	src_pattern.tag = tag;
+	return 0;
+}
+
+/* ----------------------------------------------------------------
+ * Device locality
+ * ----------------------------------------------------------------
+ *
+ * The polling loop and the pattern/verify work touch the BAR and
+ * udmabuf0 continuously, so they are kept on CPUs local to the
+ * device's NUMA node. The command thread is restricted to the whole
+ * local set; worker threads are each pinned to one CPU from it.
+ */
+/* Parse a kernel cpulist ("0-3,8,10-11") into a CPU set */
+static int parse_cpulist(const char *list, cpu_set_t *set)
+{
+	const char *p = list;
+	char *end;
+	long first, last;
+	int count = 0;
+
+	CPU_ZERO(set);
+	while (*p != '\0' && *p != '\n') {
+		first = strtol(p, &end, 10);
+		if (end == p) {
+			return -1;
+		}
+		last = first;
+		p = end;
+		if (*p == '-') {
+			p++;
+			last = strtol(p, &end, 10);
+			if ((end == p) || (last < first)) {
+				return -1;
+			}
+			p = end;
+		}
+		for (; first <= last && first < CPU_SETSIZE; first++) {
+			CPU_SET(first, set);
+			count++;
+		}
+		if (*p == ',') {
+			p++;
+		}
+	}
+	return count;
+}
+
+/* Read a sysfs attribute of the device into buf */
+static int read_dev_attr(device_t *dev, const char *attr, char *buf, int len)
+{
+	char path[128];
+	int fd, n;
+
+	snprintf(path, sizeof(path), "/sys/bus/pci/devices/%04x:%02x:%02x.%1x/%s",
+		dev->domain, dev->bus, dev->slot, dev->function, attr);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	n = read(fd, buf, len - 1);
+	close(fd);
+	if (n < 0) {
+		return -1;
+	}
+	buf[n] = '\0';
+	if ((n > 0) && (buf[n-1] == '\n')) {
+		buf[n-1] = '\0';
+	}
+	return n;
+}
+
+/* NUMA node backing the page at addr, -1 if it cannot be determined.
+ * The page is touched first, move_pages() reports -ENOENT otherwise.
+ */
+static int page_node(void *addr)
+{
+	void *pages[1] = { addr };
+	int status[1] = { -1 };
+
+	(void)*(volatile unsigned char *)addr;
+	if (syscall(SYS_move_pages, 0, 1, pages, NULL, status, 0) < 0) {
+		return -1;
+	}
+	return status[0];
+}
+
+/* NUMA node of the memory block holding physical address phys, from
+ * the nodeN/memoryM entries in sysfs; -1 if it cannot be determined.
+ * This also works for the PFN mapping of udmabuf0, which move_pages()
+ * cannot resolve.
+ */
+static int phys_node(unsigned long phys)
+{
+	char path[300], buf[32];
+	unsigned long block_size;
+	struct dirent *ent;
+	struct stat st;
+	DIR *dir;
+	int fd, n, node = -1;
+
+	fd = open("/sys/devices/system/memory/block_size_bytes", O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0) {
+		return -1;
+	}
+	buf[n] = '\0';
+	block_size = strtoul(buf, NULL, 16);
+	if (block_size == 0) {
+		return -1;
+	}
+	if ((dir = opendir("/sys/devices/system/node")) == NULL) {
+		return -1;
+	}
+	while ((node < 0) && ((ent = readdir(dir)) != NULL)) {
+		if (strncmp(ent->d_name, "node", 4) || (ent->d_name[4] < '0') ||
+		    (ent->d_name[4] > '9')) {
+			continue;
+		}
+		snprintf(path, sizeof(path), "/sys/devices/system/node/%s/memory%lu",
+			ent->d_name, phys / block_size);
+		if (stat(path, &st) == 0) {
+			node = atoi(ent->d_name + 4);
+		}
+	}
+	closedir(dir);
+	return node;
+}
+
+int placement_setup(device_t *dev)
+{
+	char buf[256];
+	const char *list = placement.cpulist;
+
+	if (read_dev_attr(dev, "numa_node", buf, sizeof(buf)) > 0) {
+		placement.node = atoi(buf);
+	}
+	if ((list == NULL) && (read_dev_attr(dev, "local_cpulist", buf, sizeof(buf)) > 0)) {
+		list = buf;
+	}
+	if (list == NULL) {
+		/* No locality information, leave the scheduler alone */
+		snprintf(placement.cpustr, sizeof(placement.cpustr), "any");
+		return 0;
+	}
+	placement.ncpus = parse_cpulist(list, &placement.cpus);
+	if (placement.ncpus <= 0) {
+		printf("Error: invalid CPU list '%s'\n", list);
+		return -1;
+	}
+	snprintf(placement.cpustr, sizeof(placement.cpustr), "%s", list);
+	if (sched_setaffinity(0, sizeof(cpu_set_t), &placement.cpus) < 0) {
+		printf("Warning: cannot bind to CPUs %s: errno %d, %s\n",
+			list, errno, strerror(errno));
+	}
+	return 0;
+}
+
+/* Check that udmabuf0 sits on the device's node, once it is mapped */
+int placement_check_buffer(void)
+{
+	int node;
+
+	/* udmabuf0 pages are allocated by the driver, so they stay put */
+	if ((boot_buffer == NULL) || (placement.node < 0)) {
+		return 0;
+	}
+	node = phys_node(phys_addr);
+	if (node < 0) {
+		node = page_node(boot_buffer);
+	}
+	if (node < 0) {
+		printf("%s: cannot determine the NUMA node of udmabuf0\n",
+			placement.strict ? "Error" : "Warning");
+		if (placement.strict) {
+			return -1;
+		}
+	} else if (node != placement.node) {
+		printf("%s: udmabuf0 is on NUMA node %d, device is on node %d\n",
+			placement.strict ? "Error" : "Warning", node, placement.node);
+		if (placement.strict) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Pin a worker thread to one local CPU, chosen round-robin */
+void placement_pin_thread(pthread_t thread, int worker)
+{
+	cpu_set_t set;
+	int cpu, n = 0;
+
+	if (placement.ncpus <= 0) {
+		return;
+	}
+	worker %= placement.ncpus;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &placement.cpus) && (n++ == worker)) {
+			break;
+		}
+	}
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	pthread_setaffinity_np(thread, sizeof(set), &set);
+}
+
+/* ----------------------------------------------------------------
+ * Link error counters
+ * ----------------------------------------------------------------
+ *
+ * A test point is bracketed by two link_health_sample() calls and
+ * link_health_delta() summarizes what happened in between: the
+ * change of the sysfs AER counters (aer_dev_correctable, _nonfatal
+ * and _fatal) and the error bits of the PCIe Device Status and Link
+ * Status registers, for the endpoint and the port above it (found
+ * through the sysfs parent directory). The status bits are RW1C, so
+ * the opening sample clears them and the closing sample sees only
+ * what was raised during the test.
+ */
+#define PCI_CAP_PTR          0x34
+#define PCI_CAP_ID_EXP       0x10
+#define PCI_EXP_DEVSTA       0x0a
+#define PCI_EXP_LNKSTA       0x12
+#define PCI_EXP_DEVSTA_ERR   0x000f    /* CED, NFED, FED, URD */
+#define PCI_EXP_LNKSTA_BW    0xc000    /* LBMS, LABS */
+
+static const char *link_port_name[LINK_PORTS] = { "EP", "RP" };
+static const char *link_count_name[3] = { "cor", "nonfatal", "fatal" };
+static const char *link_aer_file[3] = {
+	"aer_dev_correctable", "aer_dev_nonfatal", "aer_dev_fatal"
+};
+
+/* sysfs directories of the endpoint and its upstream port */
+#define LINK_DIR_LEN         256
+
+static char link_dir[LINK_PORTS][LINK_DIR_LEN];
+static int link_cap[LINK_PORTS];
+static int link_ready = 0;
+
+/* Read or write config space through the sysfs config file */
+int cfg_access(const char *dir, int write, unsigned int off, void *buf, int len)
+{
+	char path[LINK_DIR_LEN + 16];
+	int fd, n;
+
+	if (snprintf(path, sizeof(path), "%s/config", dir) >= (int)sizeof(path)) {
+		return -1;
+	}
+	fd = open(path, write ? O_RDWR : O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	n = write ? pwrite(fd, buf, len, off) : pread(fd, buf, len, off);
+	close(fd);
+	return (n == len) ? 0 : -1;
+}
+
+/* Offset of a standard capability, 0 if not found */
+static int cfg_find_cap(const char *dir, int id)
+{
+	uint8_t ptr, hdr[2];
+	int guard;
+
+	if (cfg_access(dir, 0, PCI_CAP_PTR, &ptr, 1) < 0) {
+		return 0;
+	}
+	for (guard = 0; (ptr >= 0x40) && (guard < 48); guard++) {
+		if (cfg_access(dir, 0, ptr & ~3, hdr, 2) < 0) {
+			return 0;
+		}
+		if (hdr[0] == id) {
+			return ptr & ~3;
+		}
+		ptr = hdr[1];
+	}
+	return 0;
+}
+
+static void link_health_init(device_t *dev)
+{
+	char path[128], *real, *slash;
+	unsigned int d, b, s, f;
+	int i;
+
+	snprintf(path, sizeof(path), "/sys/bus/pci/devices/%04x:%02x:%02x.%1x",
+		dev->domain, dev->bus, dev->slot, dev->function);
+	real = realpath(path, NULL);
+	snprintf(link_dir[0], sizeof(link_dir[0]), "%s", real ? real : path);
+	free(real);
+	/* The parent directory is the upstream port unless it is the host bridge */
+	snprintf(link_dir[1], sizeof(link_dir[1]), "%s", link_dir[0]);
+	slash = strrchr(link_dir[1], '/');
+	if (slash != NULL) {
+		*slash = '\0';
+		slash = strrchr(link_dir[1], '/');
+	}
+	if ((slash == NULL) || (sscanf(slash + 1, "%x:%x:%x.%x", &d, &b, &s, &f) != 4)) {
+		link_dir[1][0] = '\0';
+	}
+	for (i = 0; i < LINK_PORTS; i++) {
+		link_cap[i] = link_dir[i][0] ? cfg_find_cap(link_dir[i], PCI_CAP_ID_EXP) : 0;
+	}
+	link_ready = 1;
+}
+
+/* Total of an AER counter file; uses the TOTAL_ line when present */
+static int link_read_aer(const char *dir, const char *file, uint64_t *count)
+{
+	char path[LINK_DIR_LEN + 32], line[128];
+	char name[64];
+	unsigned long long value, sum = 0;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%63s %llu", name, &value) != 2) {
+			continue;
+		}
+		if (strncmp(name, "TOTAL_", 6) == 0) {
+			sum = value;
+			break;
+		}
+		sum += value;
+	}
+	fclose(fp);
+	*count = sum;
+	return 0;
+}
+
+void link_health_sample(device_t *dev, link_health_t *h, int clear)
+{
+	link_port_t *port;
+	uint16_t sta[2];
+	int i, k;
+
+	if (!link_ready) {
+		link_health_init(dev);
+	}
+	memset(h, 0, sizeof(*h));
+	for (i = 0; i < LINK_PORTS; i++) {
+		port = &h->port[i];
+		if (link_dir[i][0] == '\0') {
+			continue;
+		}
+		port->present = 1;
+		port->aer = 1;
+		for (k = 0; k < 3; k++) {
+			if (link_read_aer(link_dir[i], link_aer_file[k], &port->count[k]) < 0) {
+				port->aer = 0;
+			}
+		}
+		if ((link_cap[i] == 0) ||
+		    (cfg_access(link_dir[i], 0, link_cap[i] + PCI_EXP_DEVSTA, &sta[0], 2) < 0) ||
+		    (cfg_access(link_dir[i], 0, link_cap[i] + PCI_EXP_LNKSTA, &sta[1], 2) < 0)) {
+			continue;
+		}
+		port->status = 1;
+		port->devsta = sta[0];
+		port->lnksta = sta[1];
+		if (clear) {
+			sta[0] &= PCI_EXP_DEVSTA_ERR;
+			sta[1] &= PCI_EXP_LNKSTA_BW;
+			if (sta[0]) {
+				cfg_access(link_dir[i], 1, link_cap[i] + PCI_EXP_DEVSTA, &sta[0], 2);
+			}
+			if (sta[1]) {
+				cfg_access(link_dir[i], 1, link_cap[i] + PCI_EXP_LNKSTA, &sta[1], 2);
+			}
+		}
+	}
+}
+
+/* Append to out[] at n, never past len - 1; returns the new length */
+static int link_append(char *out, int len, int n, const char *fmt, ...)
+{
+	va_list ap;
+	int m;
+
+	va_start(ap, fmt);
+	m = vsnprintf(out + n, len - n, fmt, ap);
+	va_end(ap);
+	return (m < 0) ? n : ((n + m < len) ? n + m : len - 1);
+}
+
+static int link_status_names(char *out, int len, int n, uint16_t devsta, uint16_t lnksta)
+{
+	static const char *dev_bits[4] = { "CED", "NFED", "FED", "URD" };
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		if (devsta & (1 << i)) {
+			n = link_append(out, len, n, " %s", dev_bits[i]);
+		}
+	}
+	if (lnksta & 0x4000) {
+		n = link_append(out, len, n, " LBMS");
+	}
+	if (lnksta & 0x8000) {
+		n = link_append(out, len, n, " LABS");
+	}
+	return n;
+}
+
+/* Summarize the change between two samples. Returns LINK_ERRORS when
+ * an AER counter moved or a device error bit was raised, LINK_EVENTS
+ * for bandwidth change bits and speed/width changes only, 0 otherwise.
+ */
+int link_health_delta(const link_health_t *before, const link_health_t *after,
+	char *out, int len)
+{
+	const link_port_t *a, *b;
+	uint64_t d;
+	int i, k, n = 0;
+	int result = 0;
+
+	out[0] = '\0';
+	for (i = 0; i < LINK_PORTS; i++) {
+		a = &before->port[i];
+		b = &after->port[i];
+		if (!b->present) {
+			continue;
+		}
+		n = link_append(out, len, n, "%s%s", n ? "; " : "", link_port_name[i]);
+		if (b->aer && a->aer) {
+			for (k = 0; k < 3; k++) {
+				d = b->count[k] - a->count[k];
+				n = link_append(out, len, n, " %s +%llu", link_count_name[k],
+					(unsigned long long)d);
+				if (d) {
+					result |= LINK_ERRORS;
+				}
+			}
+		} else {
+			n = link_append(out, len, n, " no AER");
+		}
+		if (b->status) {
+			if (b->devsta & PCI_EXP_DEVSTA_ERR) {
+				result |= LINK_ERRORS;
+			}
+			if ((b->lnksta & PCI_EXP_LNKSTA_BW) || (a->lnksta & 0x3ff) != (b->lnksta & 0x3ff)) {
+				result |= LINK_EVENTS;
+			}
+			n = link_append(out, len, n, " gen%d x%d", b->lnksta & 0xf,
+				(b->lnksta >> 4) & 0x3f);
+			n = link_status_names(out, len, n, b->devsta & PCI_EXP_DEVSTA_ERR,
+				b->lnksta & PCI_EXP_LNKSTA_BW);
+		}
+	}
+	return result;
+}
+
+/* Compact error column for benchmark tables: cor/nonfatal/fatal, '!'
+ * when a device status error bit was raised.
+ */
+void link_health_column(const link_health_t *before, const link_health_t *after,
+	char *out, int len)
+{
+	uint64_t total[3] = { 0, 0, 0 };
+	int i, k, flag = 0;
+
+	for (i = 0; i < LINK_PORTS; i++) {
+		if (after->port[i].aer && before->port[i].aer) {
+			for (k = 0; k < 3; k++) {
+				total[k] += after->port[i].count[k] - before->port[i].count[k];
+			}
+		}
+		if (after->port[i].status && (after->port[i].devsta & PCI_EXP_DEVSTA_ERR)) {
+			flag = 1;
+		}
+	}
+	snprintf(out, len, "%llu/%llu/%llu%s", (unsigned long long)total[0],
+		(unsigned long long)total[1], (unsigned long long)total[2], flag ? "!" : "");
+}
+
+/* Close one soak test point: report errors since prev, then make
+ * this sample the start of the next point.
+ */
+void link_health_step(device_t *dev, link_health_t *prev, const char *label)
+{
+	link_health_t now;
+	char summary[256];
+
+	link_health_sample(dev, &now, 1);
+	if (link_health_delta(prev, &now, summary, sizeof(summary)) & LINK_ERRORS) {
+		printf("%s: link errors: %s\n", label, summary);
+	}
+	*prev = now;
+}
+
+int link_health_cmd(device_t *dev, char *cmd)
+{
+	link_health_t h;
+	char names[64];
+	char arg[16] = "";
+	int i, k;
+
+	sscanf(cmd, "%*s %15s", arg);
+	if (arg[0] && strcmp(arg, "clear")) {
+		printf("Syntax error (use ? for help)\n");
+		return 0;
+	}
+	link_health_sample(dev, &h, arg[0] != '\0');
+	for (i = 0; i < LINK_PORTS; i++) {
+		if (!h.port[i].present) {
+			printf("%s: not found\n", link_port_name[i]);
+			continue;
+		}
+		printf("%s: %s\n", link_port_name[i], link_dir[i]);
+		if (h.port[i].aer) {
+			printf("   ");
+			for (k = 0; k < 3; k++) {
+				printf(" %s %llu", link_count_name[k],
+					(unsigned long long)h.port[i].count[k]);
+			}
+			printf("\n");
+		} else {
+			printf("    no AER counters\n");
+		}
+		if (h.port[i].status) {
+			names[0] = '\0';
+			link_status_names(names, sizeof(names), 0, h.port[i].devsta & PCI_EXP_DEVSTA_ERR,
+				h.port[i].lnksta & PCI_EXP_LNKSTA_BW);
+			printf("    devsta %.4X lnksta %.4X: gen%d x%d%s\n",
+				h.port[i].devsta, h.port[i].lnksta, h.port[i].lnksta & 0xf,
+				(h.port[i].lnksta >> 4) & 0x3f, names[0] ? names : " no errors");
+		} else {
+			printf("    no PCIe capability access\n");
+		}
+	}
+	if (arg[0]) {
+		printf("status bits cleared\n");
+	}
+	return 0;
+}
+
+/* ----------------------------------------------------------------
+ * Phase profiler
+ * ----------------------------------------------------------------
+ *
+ * Stages of the DMA paths are bracketed with prof_begin() and
+ * prof_end(). While profiling is off prof_begin() returns 0 and
+ * prof_end() ignores it, so the cost is one test of prof_enabled.
+ * Durations go into a log-linear histogram per phase (16 steps per
+ * power of two, so percentiles are within 1/16 of the true value).
+ * With "prof trace <file>" every span is also kept in memory and
+ * written as Chrome trace JSON ("X" events) when tracing stops; the
+ * file loads in chrome://tracing and ui.perfetto.dev. The trace
+ * buffer is never freed, so a job still inside prof_end() cannot
+ * write to released memory.
+ */
+#define PROF_SUB_BITS        4
+#define PROF_BUCKETS         ((64 - PROF_SUB_BITS + 1) << PROF_SUB_BITS)
+#define PROF_TRACE_MAX       (1 << 20)
+
+typedef struct {
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t bucket[PROF_BUCKETS];
+} prof_stat_t;
+
+typedef struct {
+	uint32_t phase;
+	uint32_t tid;
+	uint64_t start_ns;
+	uint64_t dur_ns;
+} prof_span_t;
+
+static const char *prof_phase_name[PROF_PHASES] = {
+	"iteration", "setpci", "desc-rewrite", "desc-copy",
+	"pattern-fill", "doorbell", "status-spin", "verify"
+};
+
+static prof_stat_t prof_stats[PROF_PHASES];
+static prof_span_t *prof_trace = NULL;
+static volatile int prof_tracing = 0;
+static uint64_t prof_trace_used;
+static uint64_t prof_trace_start;
+static char prof_trace_path[256];
+static __thread uint32_t prof_tid = 0;
+
+static int prof_bucket(uint64_t ns)
+{
+	int e;
+
+	if (ns < (1 << PROF_SUB_BITS)) {
+		return ns;
+	}
+	e = 63 - __builtin_clzll(ns);
+	return ((e - PROF_SUB_BITS + 1) << PROF_SUB_BITS) +
+		((ns >> (e - PROF_SUB_BITS)) & ((1 << PROF_SUB_BITS) - 1));
+}
+
+/* Midpoint of a bucket */
+static double prof_bucket_ns(int b)
+{
+	int e = (b >> PROF_SUB_BITS) + PROF_SUB_BITS - 1;
+	uint64_t sub = b & ((1 << PROF_SUB_BITS) - 1);
+
+	if (b < (1 << PROF_SUB_BITS)) {
+		return b;
+	}
+	return (double)(((1ull << PROF_SUB_BITS) + sub) << (e - PROF_SUB_BITS)) +
+		(double)(1ull << (e - PROF_SUB_BITS)) / 2;
+}
+
+uint64_t prof_begin(void)
+{
+	return prof_enabled ? now_ns() : 0;
+}
+
+void prof_end(int phase, uint64_t start)
+{
+	prof_stat_t *st = &prof_stats[phase];
+	uint64_t dur, max, slot;
+
+	if (start == 0) {
+		return;
+	}
+	dur = now_ns() - start;
+
+	/* Relaxed atomics: daemon clients may run both channels at once */
+	__atomic_add_fetch(&st->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&st->total_ns, dur, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&st->bucket[prof_bucket(dur)], 1, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&st->max_ns, __ATOMIC_RELAXED);
+	while ((dur > max) && !__atomic_compare_exchange_n(&st->max_ns, &max, dur,
+			1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	if (prof_tracing) {
+		slot = __atomic_fetch_add(&prof_trace_used, 1, __ATOMIC_RELAXED);
+		if (slot < PROF_TRACE_MAX) {
+			if (prof_tid == 0) {
+				prof_tid = syscall(SYS_gettid);
+			}
+			prof_trace[slot].phase = phase;
+			prof_trace[slot].tid = prof_tid;
+			prof_trace[slot].start_ns = start;
+			prof_trace[slot].dur_ns = dur;
+		}
+	}
+}
+
+/* Stop tracing and write the spans collected so far */
+static void prof_trace_stop(void)
+{
+	prof_span_t *span;
+	uint64_t used, i;
+	FILE *fp;
+
+	if (!prof_tracing) {
+		return;
+	}
+	prof_tracing = 0;
+	span = prof_trace;
+	used = prof_trace_used;
+	if (used > PROF_TRACE_MAX) {
+		printf("trace: %llu spans dropped (limit %d)\n",
+			(unsigned long long)(used - PROF_TRACE_MAX), PROF_TRACE_MAX);
+		used = PROF_TRACE_MAX;
+	}
+
+	fp = fopen(prof_trace_path, "w");
+	if (fp == NULL) {
+		printf("Open failed for file '%s': errno %d, %s\n",
+			prof_trace_path, errno, strerror(errno));
+		return;
+	}
+	fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+		"\"args\":{\"name\":\"pci_debug\"}}", getpid());
+	for (i = 0; i < used; i++) {
+		if (span[i].start_ns < prof_trace_start) {
+			continue;
+		}
+		fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"dma\",\"ph\":\"X\","
+			"\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u}",
+			prof_phase_name[span[i].phase],
+			(span[i].start_ns - prof_trace_start) / 1e3,
+			span[i].dur_ns / 1e3, getpid(), span[i].tid);
+	}
+	fprintf(fp, "\n]}\n");
+	fclose(fp);
+	printf("trace: %llu spans written to %s\n", (unsigned long long)used,
+		prof_trace_path);
+}
+
+/* Called on exit so a running trace is not lost */
+void prof_stop(void)
+{
+	prof_enabled = 0;
+	prof_trace_stop();
+}
+
+static double prof_percentile(const prof_stat_t *st, double p)
+{
+	uint64_t want = (uint64_t)(p * st->count + 0.5);
+	uint64_t seen = 0;
+	int b;
+
+	if (want == 0) {
+		want = 1;
+	}
+	for (b = 0; b < PROF_BUCKETS; b++) {
+		seen += st->bucket[b];
+		if (seen >= want) {
+			return prof_bucket_ns(b);
+		}
+	}
+	return st->max_ns;
+}
+
+static void prof_show(void)
+{
+	const prof_stat_t *st;
+	uint64_t iter_ns = prof_stats[PROF_ITERATION].total_ns;
+	int i;
+
+	printf("%-13s %10s %10s %9s %9s %9s %9s %9s %6s\n", "phase", "count",
+		"total ms", "mean us", "p50 us", "p90 us", "p99 us", "max us", "share");
+	for (i = 0; i < PROF_PHASES; i++) {
+		st = &prof_stats[i];
+		if (st->count == 0) {
+			continue;
+		}
+		printf("%-13s %10llu %10.3f %9.3f %9.3f %9.3f %9.3f %9.3f", prof_phase_name[i],
+			(unsigned long long)st->count, st->total_ns / 1e6,
+			st->total_ns / 1e3 / st->count, prof_percentile(st, 0.5) / 1e3,
+			prof_percentile(st, 0.9) / 1e3, prof_percentile(st, 0.99) / 1e3,
+			st->max_ns / 1e3);
+		if ((i != PROF_ITERATION) && iter_ns) {
+			printf(" %5.1f%%", 100.0 * st->total_ns / iter_ns);
+		}
+		printf("\n");
+	}
+	printf("profiling is %s%s%s\n", prof_enabled ? "on" : "off",
+		prof_tracing ? ", tracing to " : "", prof_tracing ? prof_trace_path : "");
+}
+
+int prof_command(device_t *dev, char *cmd)
+{
+	char arg[16] = "", path[256] = "";
+
+	sscanf(cmd, "%*s %15s %255s", arg, path);
+	if ((arg[0] == '\0') || !strcmp(arg, "show")) {
+		prof_show();
+	} else if (!strcmp(arg, "on")) {
+		prof_enabled = 1;
+	} else if (!strcmp(arg, "off")) {
+		prof_stop();
+	} else if (!strcmp(arg, "reset")) {
+		memset(prof_stats, 0, sizeof(prof_stats));
+		prof_trace_used = 0;
+		prof_trace_start = now_ns();
+	} else if (!strcmp(arg, "trace") && !strcmp(path, "stop")) {
+		prof_trace_stop();
+	} else if (!strcmp(arg, "trace") && path[0]) {
+		prof_trace_stop();
+		if (prof_trace == NULL) {
+			prof_trace = malloc(PROF_TRACE_MAX * sizeof(prof_span_t));
+		}
+		if (prof_trace == NULL) {
+			printf("Error: cannot allocate the trace buffer\n");
+			return 0;
+		}
+		snprintf(prof_trace_path, sizeof(prof_trace_path), "%s", path);
+		prof_trace_used = 0;
+		prof_trace_start = now_ns();
+		prof_tracing = 1;
+		prof_enabled = 1;
+		printf("tracing to %s (up to %d spans)\n", path, PROF_TRACE_MAX);
+	} else {
+		printf("Syntax error (use ? for help)\n");
+	}
+	return 0;
+}
+
+/* ----------------------------------------------------------------
+ * Streaming ring DMA
+ * ----------------------------------------------------------------
+ *
+ * Two chains are built as link/data element pairs like the one-shot
+ * chains in main(), but the last link element of each points back at
+ * its head so the engine walks the rings forever. As with '1' and '2',
+ * the write channel copies each host source slot to the endpoint at
+ * ep_addr and the read channel copies it back into a host destination
+ * slot. Ownership of each data element is handed back and forth with
+ * the OWN bit: the producer fills a slot, sets OWN on its write
+ * element and rings the write doorbell; once the engine clears it the
+ * consumer hands the read element of the slot to the engine, and when
+ * that one is done it verifies the destination and releases the slot
+ * for refilling. On exit every element is taken back and both
+ * channels are stopped with the doorbell stop bit.
+ */
+#define RING_SLOT_FREE      0
+#define RING_SLOT_WRITING   1
+#define RING_SLOT_READING   2
+
+/* Consumer waits longer than this count as a ring stall */
+#define RING_STALL_NS       10000000ull
+/* No completion for this long aborts the run */
+#define RING_TIMEOUT_NS     1000000000ull
+
+typedef struct {
+	device_t          *dev;
+	volatile desc_info *wdesc;
+	volatile desc_info *rdesc;
+	uint32_t           slots;
+	uint32_t           size;
+	volatile int       stop;
+	int                error;
+
+	/* Per slot ownership and the sequence number it was filled with */
+	int                state[RING_MAX_SLOTS];
+	uint32_t           seq[RING_MAX_SLOTS];
+
+	/* Statistics */
+	uint64_t           completed;
+	uint64_t           bytes;
+	uint64_t           mismatches;
+	uint64_t           stalls;
+	uint64_t           producer_waits;
+	uint64_t           max_gap_ns;
+} ring_ctx_t;
+
+static void *ring_producer(void *arg)
+{
+	ring_ctx_t *ring = arg;
+	uint32_t slot = 0;
+	uint32_t seq = ring->slots + 1;
+	int waiting = 0;
+	void *src, *dst;
+
+	while (!ring->stop) {
+		if (__atomic_load_n(&ring->state[slot], __ATOMIC_ACQUIRE) != RING_SLOT_FREE) {
+			/* Count each time the ring runs full, not each poll */
+			if (!waiting) {
+				ring->producer_waits++;
+				waiting = 1;
+			}
+			sched_yield();
+			continue;
+		}
+		waiting = 0;
+		src = boot_buffer + RING_SRC_OFF + slot * ring->size;
+		dst = boot_buffer + RING_DST_OFF + slot * ring->size;
+		pattern_fill(&src_pattern, seq, src, ring->size, ring->size, 0);
+		/* Poison the destination so a skipped transfer cannot pass */
+		memset(dst, 0xa5, ring->size);
+		ring->seq[slot] = seq++;
+
+		/* Buffers must be visible before the engine owns the element,
+		 * and OWN must be set before the consumer sees the slot.
+		 */
+		__sync_synchronize();
+		ring->wdesc[2*slot + 1].desc_ctrl.OWN = 1;
+		__sync_synchronize();
+		__atomic_store_n(&ring->state[slot], RING_SLOT_WRITING, __ATOMIC_RELEASE);
+		store_le32(ring->dev, DMA_WR_DOORBELL, 1);
+
+		slot = (slot + 1) % ring->slots;
+	}
+	return NULL;
+}
+
+/* Back off briefly in a polling loop without giving up the CPU */
+static inline void ring_relax(void)
+{
+#if defined(__x86_64__)
+	_mm_pause();
+#else
+	sched_yield();
+#endif
+}
+
+/* Take every element back from the engine and stop both channels */
+static void ring_halt(ring_ctx_t *ring)
+{
+	uint64_t start;
+	uint32_t i;
+
+	for (i = 0; i < ring->slots; i++) {
+		ring->wdesc[2*i + 1].desc_ctrl.OWN = 0;
+		ring->rdesc[2*i + 1].desc_ctrl.OWN = 0;
+	}
+	__sync_synchronize();
+	write_le32(ring->dev, DMA_WR_DOORBELL, DMA_DOORBELL_STOP);
+	write_le32(ring->dev, DMA_RD_DOORBELL, DMA_DOORBELL_STOP);
+	start = now_ns();
+	while (read_le32(ring->dev, DMA_STATUS) & (DMA_STATUS_WR_BUSY | DMA_STATUS_RD_BUSY)) {
+		if ((now_ns() - start) > RING_TIMEOUT_NS) {
+			printf("ring: channels still busy after stop (DMA status %#x)\n",
+				read_le32(ring->dev, DMA_STATUS));
+			break;
+		}
+		ring_relax();
+	}
+}
+
+static void *ring_consumer(void *arg)
+{
+	ring_ctx_t *ring = arg;
+	uint32_t wslot = 0, rslot = 0;
+	uint64_t last, now, gap;
+	int stalled = 0;
+	int progress;
+	int bad;
+
+	last = now_ns();
+	while (!ring->stop) {
+		progress = 0;
+
+		/* Written to the endpoint: start reading it back */
+		if ((__atomic_load_n(&ring->state[wslot], __ATOMIC_ACQUIRE) == RING_SLOT_WRITING) &&
+		    !ring->wdesc[2*wslot + 1].desc_ctrl.OWN) {
+			__sync_synchronize();
+			ring->rdesc[2*wslot + 1].desc_ctrl.OWN = 1;
+			__sync_synchronize();
+			__atomic_store_n(&ring->state[wslot], RING_SLOT_READING, __ATOMIC_RELEASE);
+			store_le32(ring->dev, DMA_RD_DOORBELL, 1);
+			wslot = (wslot + 1) % ring->slots;
+			progress = 1;
+		}
+
+		/* Read back: verify and release the slot */
+		if ((__atomic_load_n(&ring->state[rslot], __ATOMIC_ACQUIRE) == RING_SLOT_READING) &&
+		    !ring->rdesc[2*rslot + 1].desc_ctrl.OWN) {
+			__sync_synchronize();
+			bad = pattern_check(&src_pattern, ring->seq[rslot],
+				boot_buffer + RING_DST_OFF + rslot * ring->size,
+				ring->size, ring->size, 0);
+			if (bad >= 0) {
+				if (ring->mismatches++ == 0) {
+					printf("ring: slot %u seq %u mismatch at offset %#x\n",
+						rslot, ring->seq[rslot], bad);
+				}
+			}
+			now = now_ns();
+			if ((now - last) > ring->max_gap_ns) {
+				ring->max_gap_ns = now - last;
+			}
+			last = now;
+			stalled = 0;
+			ring->completed++;
+			ring->bytes += ring->size;
+			__atomic_store_n(&ring->state[rslot], RING_SLOT_FREE, __ATOMIC_RELEASE);
+			rslot = (rslot + 1) % ring->slots;
+			progress = 1;
+		}
+
+		if (!progress) {
+			gap = now_ns() - last;
+			if ((gap > RING_STALL_NS) && !stalled) {
+				ring->stalls++;
+				stalled = 1;
+			}
+			if (gap > RING_TIMEOUT_NS) {
+				printf("ring: engine stalled at slot %u (DMA status %#x)\n",
+					rslot, read_le32(ring->dev, DMA_STATUS));
+				ring->error = 1;
+				ring->stop = 1;
+				break;
+			}
+			ring_relax();
+		}
+	}
+	return NULL;
+}
+
+/* Build one ring of link/data pairs, closed by a link back to the head */
+static void ring_build(volatile desc_info *d, unsigned long d_phys, uint32_t slots,
+	uint32_t size, unsigned long sar, unsigned long dar)
+{
+	uint32_t i;
+
+	memset((void *)d, 0, (2*slots + 1) * sizeof(desc_info));
+	for (i = 0; i < slots; i++) {
+		d[2*i].SAR_High = d_phys + sizeof(desc_info) * (2*i + 1);
+		d[2*i].desc_ctrl.LLP = 1;
+
+		d[2*i + 1].SAR_Low = sar + i * size;
+		d[2*i + 1].DAR_Low = dar + i * size;
+		d[2*i + 1].Transfer_Size = size;
+		d[2*i + 1].desc_ctrl.LIE = 1;
+	}
+	d[2*slots].SAR_High = d_phys;
+	d[2*slots].desc_ctrl.LLP = 1;
+}
+
+int ring_stream(device_t *dev, char *cmd)
+{
+	ring_ctx_t ring, seen;
+	link_health_t link_before, link_after;
+	char summary[256];
+	pthread_t producer, consumer;
+	uint32_t slots = 16;
+	uint32_t size = 0x1000;
+	int secs = 5;
+	uint32_t i;
+	uint64_t start, elapsed;
+	int status;
+
+	if (dma_prepare() < 0) {
+		return 0;
+	}
+	status = sscanf(cmd, "%*s %u %x %d", &slots, &size, &secs);
+	if ((status == 0) || (slots < 2) || (slots > RING_MAX_SLOTS) ||
+	    (size == 0) || (size & 3) || (secs < 0)) {
+		printf("Syntax error (use ? for help)\n");
+		return 0;
+	}
+	if (size > RING_AREA_SIZE / slots) {
+		printf("Error: ring of %u x %#x bytes exceeds %#x-byte buffer area\n",
+			slots, size, RING_AREA_SIZE);
+		return 0;
+	}
+	if ((secs == 0) && !job_active()) {
+		printf("Error: ring without a time limit must run as a background job\n");
+		return 0;
+	}
+	/* The ring uses both channels and their scratch areas */
+	if (dma_claim(DMA_CHAN_BOTH, 0) < 0) {
+		return 0;
+	}
+
+	memset(&ring, 0, sizeof(ring));
+	ring.dev = dev;
+	ring.wdesc = (volatile desc_info *)(boot_buffer + RING_WR_DESC_OFF);
+	ring.rdesc = (volatile desc_info *)(boot_buffer + RING_RD_DESC_OFF);
+	ring.slots = slots;
+	ring.size = size;
+
+	/* Host source -> endpoint -> host destination */
+	ring_build(ring.wdesc, phys_addr + RING_WR_DESC_OFF, slots, size,
+		phys_addr + RING_SRC_OFF, ep_addr);
+	ring_build(ring.rdesc, phys_addr + RING_RD_DESC_OFF, slots, size,
+		ep_addr, phys_addr + RING_DST_OFF);
+	for (i = 0; i < slots; i++) {
+		pattern_fill(&src_pattern, i + 1, boot_buffer + RING_SRC_OFF + i * size,
+			size, size, 0);
+		memset(boot_buffer + RING_DST_OFF + i * size, 0xa5, size);
+		ring.seq[i] = i + 1;
+		ring.state[i] = RING_SLOT_WRITING;
+		ring.wdesc[2*i + 1].desc_ctrl.OWN = 1;
+	}
+	__sync_synchronize();
+
+	printf("ring: %u slots x %#x bytes via endpoint %#x, %d s\n",
+		slots, size, ep_addr, secs);
+	link_health_sample(dev, &link_before, 1);
+	store_le32(dev, DMA_RD_LLP, phys_addr + RING_RD_DESC_OFF);
+	store_le32(dev, DMA_WR_LLP, phys_addr + RING_WR_DESC_OFF);
+	store_le32(dev, DMA_WR_DOORBELL, slots);
+
+	start = now_ns();
+	seen = ring;
+	if (pthread_create(&consumer, NULL, ring_consumer, &ring) != 0) {
+		printf("Error: cannot start the ring consumer thread\n");
+		ring_halt(&ring);
+		dma_release(DMA_CHAN_BOTH);
+		return 0;
+	}
+	if (pthread_create(&producer, NULL, ring_producer, &ring) != 0) {
+		printf("Error: cannot start the ring producer thread\n");
+		ring.stop = 1;
+		pthread_join(consumer, NULL);
+		ring_halt(&ring);
+		dma_release(DMA_CHAN_BOTH);
+		return 0;
+	}
+	placement_pin_thread(consumer, 1);
+	placement_pin_thread(producer, 2);
+	while (!ring.stop && !job_stopping() &&
+	       ((secs == 0) || ((now_ns() - start) < (uint64_t)secs * 1000000000ull))) {
+		usleep(10000);
+		job_count(ring.completed - seen.completed, ring.bytes - seen.bytes,
+			ring.mismatches - seen.mismatches);
+		seen = ring;
+		job_note("%llu stalls, longest gap %.3f ms",
+			(unsigned long long)ring.stalls, ring.max_gap_ns / 1e6);
+	}
+	ring.stop = 1;
+	pthread_join(producer, NULL);
+	pthread_join(consumer, NULL);
+	elapsed = now_ns() - start;
+	ring_halt(&ring);
+	dma_release(DMA_CHAN_BOTH);
+	link_health_sample(dev, &link_after, 0);
+
+	printf("ring: %llu transfers, %llu bytes in %.3f s\n",
+		(unsigned long long)ring.completed,
+		(unsigned long long)ring.bytes, elapsed / 1e9);
+	printf("ring: sustained %.2f MB/s, %.0f transfers/s\n",
+		ring.bytes / (elapsed / 1e9) / 1e6,
+		ring.completed / (elapsed / 1e9));
+	printf("ring: %llu stalls (> %llu ms), longest gap %.3f ms, "
+		"%llu producer waits\n",
+		(unsigned long long)ring.stalls, RING_STALL_NS / 1000000ull,
+		ring.max_gap_ns / 1e6, (unsigned long long)ring.producer_waits);
+	printf("ring: %llu mismatches%s\n", (unsigned long long)ring.mismatches,
+		ring.error ? ", aborted" : "");
+	link_health_delta(&link_before, &link_after, summary, sizeof(summary));
+	printf("ring: link %s\n", summary);
+	return 0;
+}
+
+/* ----------------------------------------------------------------
+ * PIO vs. DMA crossover benchmark
+ * ----------------------------------------------------------------
+ *
+ * Copies a host buffer into and out of a scratch window of the BAR
+ * with each CPU access style, and times single-element DMA transfers
+ * of the same sizes. The crossover is the smallest size at which the
+ * DMA engine beats the fastest PIO style in that direction.
+ *
+ * The window must be scratch memory on the endpoint; the benchmark
+ * overwrites it, and the DMA side overwrites up to max bytes of
+ * endpoint memory at ep (ep_addr unless given). Non-temporal styles use the write-combined
+ * resource<N>_wc mapping, which only exists for prefetchable BARs.
+ */
+
+/* Descriptors for single transfers, between the one-shot chains and
+ * the ring; one area per channel so both can run at once.
+ */
+#define BENCH_DESC_OFF      0x3000
+#define BENCH_DESC_CHAN     0x100
+#define BENCH_MIN_NS        1000000ull
+#define BENCH_MAX_REPS      64
+
+typedef struct {
+	const char *name;
+	int         wc;            /* uses the write-combined mapping */
+	uint32_t    granule;       /* access size in bytes */
+	void      (*write)(device_t *dev, unsigned char *map, unsigned int addr,
+			const void *buf, uint32_t len);
+	void      (*read)(device_t *dev, unsigned char *map, unsigned int addr,
+			void *buf, uint32_t len);
+	int       (*supported)(void);
+} pio_style_t;
+
+static void pio_wr_le32(device_t *dev, unsigned char *map, unsigned int addr,
+	const void *buf, uint32_t len)
+{
+	const uint32_t *src = buf;
+	uint32_t i;
+
+	for (i = 0; i < len / 4; i++) {
+		write_le32(dev, addr + 4*i, src[i]);
+	}
+}
+
+static void pio_rd_le32(device_t *dev, unsigned char *map, unsigned int addr,
+	void *buf, uint32_t len)
+{
+	uint32_t *dst = buf;
+	uint32_t i;
+
+	for (i = 0; i < len / 4; i++) {
+		dst[i] = read_le32(dev, addr + 4*i);
+	}
+}
+
+static void pio_wr_32(device_t *dev, unsigned char *map, unsigned int addr,
+	const void *buf, uint32_t len)
+{
+	volatile uint32_t *dst = (volatile uint32_t *)(map + addr);
+	const uint32_t *src = buf;
+	uint32_t i;
+
+	for (i = 0; i < len / 4; i++) {
+		dst[i] = src[i];
+	}
+}
+
+static void pio_rd_32(device_t *dev, unsigned char *map, unsigned int addr,
+	void *buf, uint32_t len)
+{
+	volatile uint32_t *src = (volatile uint32_t *)(map + addr);
+	uint32_t *dst = buf;
+	uint32_t i;
+
+	for (i = 0; i < len / 4; i++) {
+		dst[i] = src[i];
+	}
+}
+
+static void pio_wr_64(device_t *dev, unsigned char *map, unsigned int addr,
+	const void *buf, uint32_t len)
+{
+	volatile uint64_t *dst = (volatile uint64_t *)(map + addr);
+	const uint64_t *src = buf;
+	uint32_t i;
+
+	for (i = 0; i < len / 8; i++) {
+		dst[i] = src[i];
+	}
+}
+
+static void pio_rd_64(device_t *dev, unsigned char *map, unsigned int addr,
+	void *buf, uint32_t len)
+{
+	volatile uint64_t *src = (volatile uint64_t *)(map + addr);
+	uint64_t *dst = buf;
+	uint32_t i;
+
+	for (i = 0; i < len / 8; i++) {
+		dst[i] = src[i];
+	}
+}
+
+#if defined(__x86_64__)
+static int cpu_has_avx(void)
+{
+	return __builtin_cpu_supports("avx");
+}
+
+static int cpu_has_sse41(void)
+{
+	return __builtin_cpu_supports("sse4.1");
+}
+
+static void pio_wr_sse(device_t *dev, unsigned char *map, unsigned int addr,
+	const void *buf, uint32_t len)
+{
+	__m128i *dst = (__m128i *)(map + addr);
+	const __m128i *src = buf;
+	uint32_t i;
+
+	for (i = 0; i < len / 16; i++) {
+		_mm_store_si128(&dst[i], _mm_loadu_si128(&src[i]));
+	}
+}
+
+static void pio_rd_sse(device_t *dev, unsigned char *map, unsigned int addr,
+	void *buf, uint32_t len)
+{
+	const __m128i *src = (const __m128i *)(map + addr);
+	__m128i *dst = buf;
+	uint32_t i;
+
+	for (i = 0; i < len / 16; i++) {
+		_mm_storeu_si128(&dst[i], _mm_load_si128(&src[i]));
+	}
+}
+
+__attribute__((target("avx")))
+static void pio_wr_avx(device_t *dev, unsigned char *map, unsigned int addr,
+	const void *buf, uint32_t len)
+{
+	__m256i *dst = (__m256i *)(map + addr);
+	const __m256i *src = buf;
+	uint32_t i;
+
+	for (i = 0; i < len / 32; i++) {
+		_mm256_store_si256(&dst[i], _mm256_loadu_si256(&src[i]));
+	}
+}
+
+__attribute__((target("avx")))
+static void pio_rd_avx(device_t *dev, unsigned char *map, unsigned int addr,
+	void *buf, uint32_t len)
+{
+	const __m256i *src = (const __m256i *)(map + addr);
+	__m256i *dst = buf;
+	uint32_t i;
+
+	for (i = 0; i < len / 32; i++) {
+		_mm256_storeu_si256(&dst[i], _mm256_load_si256(&src[i]));
+	}
+}
+
+static void pio_wr_nt(device_t *dev, unsigned char *map, unsigned int addr,
+	const void *buf, uint32_t len)
+{
+	__m128i *dst = (__m128i *)(map + addr);
+	const __m128i *src = buf;
+	uint32_t i;
+
+	for (i = 0; i < len / 16; i++) {
+		_mm_stream_si128(&dst[i], _mm_loadu_si128(&src[i]));
+	}
+	_mm_sfence();
+}
+
+__attribute__((target("sse4.1")))
+static void pio_rd_nt(device_t *dev, unsigned char *map, unsigned int addr,
+	void *buf, uint32_t len)
+{
+	__m128i *src = (__m128i *)(map + addr);
+	__m128i *dst = buf;
+	uint32_t i;
+
+	for (i = 0; i < len / 16; i++) {
+		_mm_storeu_si128(&dst[i], _mm_stream_load_si128(&src[i]));
+	}
+}
+#endif
+
+static pio_style_t pio_styles[] = {
+	{"le32",   0,  4, pio_wr_le32, pio_rd_le32, NULL},
+	{"32-bit", 0,  4, pio_wr_32,   pio_rd_32,   NULL},
+	{"64-bit", 0,  8, pio_wr_64,   pio_rd_64,   NULL},
+#if defined(__x86_64__)
+	{"SSE",    0, 16, pio_wr_sse,  pio_rd_sse,  NULL},
+	{"AVX",    0, 32, pio_wr_avx,  pio_rd_avx,  cpu_has_avx},
+	{"NT/WC",  1, 16, pio_wr_nt,   pio_rd_nt,   cpu_has_sse41},
+#endif
+	{NULL, 0, 0, NULL, NULL, NULL}
+};
+
+/* Run one single-element transfer and return its duration in ns,
+ * 0 on timeout. to_ep selects the write channel (host -> endpoint),
+ * otherwise the read channel moves endpoint -> host.
+ */
+static uint64_t dma_single(device_t *dev, int to_ep, unsigned long host,
+	uint32_t ep, uint32_t size)
+{
+	unsigned int d_off = BENCH_DESC_OFF + (to_ep ? 0 : BENCH_DESC_CHAN);
+	volatile desc_info *d = (volatile desc_info *)(boot_buffer + d_off);
+	unsigned long d_phys = phys_addr + d_off;
+	unsigned int llp = to_ep ? DMA_WR_LLP : DMA_RD_LLP;
+	unsigned int db = to_ep ? DMA_WR_DOORBELL : DMA_RD_DOORBELL;
+	unsigned int busy = to_ep ? DMA_STATUS_WR_BUSY : DMA_STATUS_RD_BUSY;
+	uint64_t start, elapsed, t;
+
+	memset((void *)d, 0, 2 * sizeof(desc_info));
+	d[0].SAR_High = d_phys + sizeof(desc_info);
+	d[0].desc_ctrl.LLP = 1;
+	d[1].SAR_Low = to_ep ? host : ep;
+	d[1].DAR_Low = to_ep ? ep : host;
+	d[1].Transfer_Size = size;
+	d[1].desc_ctrl.INT = 1;
+	d[1].desc_ctrl.LIE = 1;
+	d[1].desc_ctrl.Stop = 1;
+	d[1].desc_ctrl.OWN = 1;
+	__sync_synchronize();
+
+	/* Plain stores: write_le32() sleeps, which would be timed as DMA */
+	start = now_ns();
+	t = prof_begin();
+	store_le32(dev, llp, d_phys);
+	store_le32(dev, db, 1);
+	prof_end(PROF_DOORBELL, t);
+	t = prof_begin();
+	while (read_le32(dev, DMA_STATUS) & busy) {
+		if ((now_ns() - start) > 1000000000ull) {
+			return 0;
+		}
+	}
+	elapsed = now_ns() - start;
+	prof_end(PROF_SPIN, t);
+	return elapsed ? elapsed : 1;
+}
+
+/* Best-of-N time for one PIO copy; the first run warms up the path */
+static uint64_t pio_time(device_t *dev, pio_style_t *style, int to_bar,
+	unsigned char *map, unsigned int addr, void *buf, uint32_t len)
+{
+	uint64_t t, best = ~0ull, total = 0;
+	int rep;
+
+	for (rep = 0; (rep < BENCH_MAX_REPS) && ((rep < 2) || (total < BENCH_MIN_NS)); rep++) {
+		t = now_ns();
+		if (to_bar) {
+			style->write(dev, map, addr, buf, len);
+		} else {
+			style->read(dev, map, addr, buf, len);
+		}
+		t = now_ns() - t;
+		total += t;
+		if ((rep > 0) && (t < best)) {
+			best = t;
+		}
+	}
+	return best;
+}
+
+static uint64_t dma_time(device_t *dev, int to_ep, uint32_t ep, uint32_t len)
+{
+	uint64_t t, best = ~0ull, total = 0;
+	int rep;
+
+	for (rep = 0; (rep < BENCH_MAX_REPS) && ((rep < 2) || (total < BENCH_MIN_NS)); rep++) {
+		t = dma_single(dev, to_ep, phys_addr + RING_SRC_OFF, ep, len);
+		if (t == 0) {
+			return 0;
+		}
+		total += t;
+		if ((rep > 0) && (t < best)) {
+			best = t;
+		}
+	}
+	return best;
+}
+
+static void pio_bench_direction(device_t *dev, int to_bar, unsigned char *wc,
+	unsigned int addr, uint32_t ep, uint32_t min, uint32_t max)
+{
+	pio_style_t *style;
+	unsigned char *map;
+	void *buf = boot_buffer + RING_SRC_OFF;
+	uint32_t len, crossover = 0;
+	uint64_t t, best, dma;
+	link_health_t before, after;
+	char errors[32];
+
+	printf("\n%s (MB/s)\n", to_bar ? "Host -> BAR" : "BAR -> Host");
+	printf("%8s", "size");
+	for (style = pio_styles; style->name != NULL; style++) {
+		printf(" %8s", style->name);
+	}
+	printf(" %8s %10s\n", "DMA", "errors");
+
+	for (len = min; (len <= max) && !job_stopping(); len *= 2) {
+		link_health_sample(dev, &before, 1);
+		printf("%8x", len);
+		best = ~0ull;
+		for (style = pio_styles; style->name != NULL; style++) {
+			map = style->wc ? wc : dev->addr;
+			if ((map == NULL) || (len % style->granule) ||
+			    ((style->supported != NULL) && !style->supported())) {
+				printf(" %8s", "-");
+				continue;
+			}
+			t = pio_time(dev, style, to_bar, map, addr, buf, len);
+			if (t < best) {
+				best = t;
+			}
+			printf(" %8.1f", len * 1e3 / t);
+		}
+		dma = dma_time(dev, to_bar, ep, len);
+		link_health_sample(dev, &after, 0);
+		link_health_column(&before, &after, errors, sizeof(errors));
+		if (dma == 0) {
+			printf(" %8s %10s\n", "timeout", errors);
+			continue;
+		}
+		printf(" %8.1f %10s\n", len * 1e3 / dma, errors);
+		job_count(1, len, 0);
+		job_note("%s, size %#x", to_bar ? "host -> BAR" : "BAR -> host", len);
+		if ((crossover == 0) && (dma < best)) {
+			crossover = len;
+		}
+	}
+	printf("errors: AER cor/nonfatal/fatal during the row (EP + RP), "
+		"! = device status error\n");
+	if (crossover) {
+		printf("crossover: DMA is faster from %#x bytes\n", crossover);
+	} else {
+		printf("crossover: PIO is faster over the whole range\n");
+	}
+}
+
+int pio_bench(device_t *dev, char *cmd)
+{
+	unsigned int addr = 0;
+	uint32_t min = 4, max = 0x10000;
+	uint32_t ep = ep_addr;
+	unsigned char *wc = NULL;
+	void *wc_map = MAP_FAILED;
+	char wcname[128];
+	int status;
+	int fd;
+
+	status = sscanf(cmd, "%*s %x %x %x %x", &addr, &min, &max, &ep);
+	if ((status < 1) || (min < 4) || (min > max) || (addr & 0x1f)) {
+		printf("Syntax error (use ? for help)\n");
+		return 0;
+	}
+	if ((addr > dev->size) || (max > dev->size - addr)) {
+		printf("Error: window %#x+%#x exceeds the %#x-byte BAR\n", addr, max, dev->size);
+		return 0;
+	}
+	if (max > 0xffffffffu - ep) {
+		printf("Error: endpoint window %#x+%#x wraps\n", ep, max);
+		return 0;
+	}
+	if (dma_prepare() < 0) {
+		return 0;
+	}
+	if (max > RING_AREA_SIZE) {
+		printf("Error: maximum size is %#x bytes\n", RING_AREA_SIZE);
+		return 0;
+	}
+	if (dma_claim(DMA_CHAN_BOTH, 0) < 0) {
+		return 0;
+	}
+
+	snprintf(wcname, sizeof(wcname), "%s_wc", dev->filename);
+	fd = open(wcname, O_RDWR | O_SYNC);
+	if (fd >= 0) {
+		wc_map = mmap(NULL, dev->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+	}
+	if (wc_map != MAP_FAILED) {
+		wc = (unsigned char *)wc_map + dev->offset;
+	} else {
+		printf("note: no write-combined mapping (%s), NT/WC skipped\n", wcname);
+	}
+
+	memset(boot_buffer + RING_SRC_OFF, 0x5a, max);
+	pio_bench_direction(dev, 1, wc, addr, ep, min, max);
+	pio_bench_direction(dev, 0, wc, addr, ep, min, max);
+
+	if (wc_map != MAP_FAILED) {
+		munmap(wc_map, dev->size);
+	}
+	dma_release(DMA_CHAN_BOTH);
+	return 0;
+}
+
+/* ----------------------------------------------------------------
+ * BAR snapshots
+ * ----------------------------------------------------------------
+ *
+ * snap captures a BAR window into host memory with wide reads, diff
+ * compares two snapshots (or a snapshot against the live BAR) and
+ * prints only the 32-bit words that changed. Equal stretches are
+ * skipped a vector at a time, so large windows diff at memory speed.
+ */
+#define SNAP_MAX            16
+#define SNAP_NAME_LEN       32
+
+typedef struct {
+	char          name[SNAP_NAME_LEN];
+	unsigned int  addr;
+	uint32_t      len;
+	uint32_t     *data;
+} snapshot_t;
+
+static snapshot_t snapshots[SNAP_MAX];
+
+/* Read a BAR window with the widest aligned accesses available */
+static void bar_read_wide(device_t *dev, unsigned int addr, void *buf, uint32_t len)
+{
+	unsigned char *dst = buf;
+	unsigned int start = addr;
+	uint32_t total = len;
+	uint32_t n;
+
+	/* 32-bit head up to a 32-byte boundary */
+	while ((len >= 4) && (addr & 0x1f)) {
+		*(uint32_t *)dst = *(volatile uint32_t *)(dev->addr + addr);
+		addr += 4;
+		dst += 4;
+		len -= 4;
+	}
+	n = len & ~0x1fu;
+#if defined(__x86_64__)
+	if (n && cpu_has_avx()) {
+		pio_rd_avx(dev, dev->addr, addr, dst, n);
+	} else if (n) {
+		pio_rd_sse(dev, dev->addr, addr, dst, n);
+	}
+#else
+	if (n) {
+		pio_rd_64(dev, dev->addr, addr, dst, n);
+	}
+#endif
+	addr += n;
+	dst += n;
+	len -= n;
+	while (len >= 4) {
+		*(uint32_t *)dst = *(volatile uint32_t *)(dev->addr + addr);
+		addr += 4;
+		dst += 4;
+		len -= 4;
+	}
+	if (rec_fp != NULL) {
+		rec_data(REC_READ_BLOCK, 4, start, buf, total - len);
+	}
+}
+
+/* Index of the first word >= i where a and b differ, n if none */
+static uint32_t diff_next_generic(const uint32_t *a, const uint32_t *b,
+	uint32_t i, uint32_t n)
+{
+	while ((i < n) && (a[i] == b[i])) {
+		i++;
+	}
+	return i;
+}
+
+#if defined(__x86_64__)
+static uint32_t diff_next_sse2(const uint32_t *a, const uint32_t *b,
+	uint32_t i, uint32_t n)
+{
+	__m128i va, vb;
+	int mask;
+
+	while ((i & 3) && (i < n)) {
+		if (a[i] != b[i]) {
+			return i;
+		}
+		i++;
+	}
+	for (; i + 4 <= n; i += 4) {
+		va = _mm_loadu_si128((const __m128i *)&a[i]);
+		vb = _mm_loadu_si128((const __m128i *)&b[i]);
+		mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(va, vb)));
+		if (mask != 0xf) {
+			return i + __builtin_ctz(~mask);
+		}
+	}
+	return diff_next_generic(a, b, i, n);
+}
+
+__attribute__((target("avx2")))
+static uint32_t diff_next_avx2(const uint32_t *a, const uint32_t *b,
+	uint32_t i, uint32_t n)
+{
+	__m256i va, vb, wa, wb;
+	int mask;
+
+	while ((i & 7) && (i < n)) {
+		if (a[i] != b[i]) {
+			return i;
+		}
+		i++;
+	}
+	/* Two vectors per step; only locate the word once a block differs */
+	for (; i + 16 <= n; i += 16) {
+		va = _mm256_loadu_si256((const __m256i *)&a[i]);
+		vb = _mm256_loadu_si256((const __m256i *)&b[i]);
+		wa = _mm256_loadu_si256((const __m256i *)&a[i + 8]);
+		wb = _mm256_loadu_si256((const __m256i *)&b[i + 8]);
+		if (!_mm256_testz_si256(_mm256_xor_si256(va, vb), _mm256_xor_si256(va, vb)) ||
+		    !_mm256_testz_si256(_mm256_xor_si256(wa, wb), _mm256_xor_si256(wa, wb))) {
+			break;
+		}
+	}
+	for (; i + 8 <= n; i += 8) {
+		va = _mm256_loadu_si256((const __m256i *)&a[i]);
+		vb = _mm256_loadu_si256((const __m256i *)&b[i]);
+		mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(va, vb)));
+		if (mask != 0xff) {
+			return i + __builtin_ctz(~mask);
+		}
+	}
+	return diff_next_generic(a, b, i, n);
+}
+#endif
+
+static uint32_t diff_next(const uint32_t *a, const uint32_t *b, uint32_t i, uint32_t n)
+{
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("avx2")) {
+		return diff_next_avx2(a, b, i, n);
+	}
+	return diff_next_sse2(a, b, i, n);
+#else
+	return diff_next_generic(a, b, i, n);
+#endif
+}
+
+static snapshot_t *snap_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < SNAP_MAX; i++) {
+		if ((snapshots[i].data != NULL) && (strcmp(snapshots[i].name, name) == 0)) {
+			return &snapshots[i];
+		}
+	}
+	return NULL;
+}
+
+int snap_mem(device_t *dev, char *cmd)
+{
+	char name[SNAP_NAME_LEN];
+	unsigned int addr = 0;
+	uint32_t len = 0;
+	snapshot_t *snap;
+	uint64_t t;
+	int status;
+	int i;
+
+	status = sscanf(cmd, "%*s %31s %x %x", name, &addr, &len);
+	if (status < 0) {
+		/* List the snapshots */
+		for (i = 0; i < SNAP_MAX; i++) {
+			if (snapshots[i].data != NULL) {
+				printf("  %-16s %.8X %.8X\n", snapshots[i].name,
+					snapshots[i].addr, snapshots[i].len);
+			}
+		}
+		return 0;
+	}
+	if ((status != 3) || (len == 0) || (addr & 3) || (len & 3)) {
+		printf("Syntax error (use ? for help)\n");
+		return 0;
+	}
+	if ((addr > dev->size) || (len > dev->size - addr)) {
+		printf("Error: invalid address (maximum allowed is %.8X\n", dev->size);
+		return 0;
+	}
+
+	snap = snap_find(name);
+	if (snap == NULL) {
+		for (i = 0; (i < SNAP_MAX) && (snapshots[i].data != NULL); i++);
+		if (i == SNAP_MAX) {
+			printf("Error: all %d snapshots in use\n", SNAP_MAX);
+			return 0;
+		}
+		snap = &snapshots[i];
+	} else {
+		free(snap->data);
+		snap->data = NULL;
+	}
+	if (posix_memalign((void **)&snap->data, 64, len) != 0) {
+		snap->data = NULL;
+		printf("Error: cannot allocate %#x bytes\n", len);
+		return 0;
+	}
+	snprintf(snap->name, sizeof(snap->name), "%s", name);
+	snap->addr = addr;
+	snap->len = len;
+
+	t = now_ns();
+	bar_read_wide(dev, addr, snap->data, len);
+	t = now_ns() - t;
+	printf("%s: %#x bytes from %.8X in %.3f ms\n", name, len, addr, t / 1e6);
+	return 0;
+}
+
+int diff_mem(device_t *dev, char *cmd)
+{
+	char name_a[SNAP_NAME_LEN], name_b[SNAP_NAME_LEN];
+	snapshot_t *a, *b;
+	uint32_t *live = NULL;
+	const uint32_t *old, *new;
+	uint32_t n, i, o, v, changed = 0;
+	uint64_t t;
+	int status;
+
+	status = sscanf(cmd, "%*s %31s %31s", name_a, name_b);
+	if (status < 1) {
+		printf("Syntax error (use ? for help)\n");
+		return 0;
+	}
+	a = snap_find(name_a);
+	if (a == NULL) {
+		printf("Error: no snapshot '%s'\n", name_a);
+		return 0;
+	}
+	old = a->data;
+	if (status == 2) {
+		b = snap_find(name_b);
+		if (b == NULL) {
+			printf("Error: no snapshot '%s'\n", name_b);
+			return 0;
+		}
+		if ((b->addr != a->addr) || (b->len != a->len)) {
+			printf("Error: '%s' and '%s' cover different windows\n", name_a, name_b);
+			return 0;
+		}
+		new = b->data;
+	} else {
+		/* Against the live BAR */
+		if (posix_memalign((void **)&live, 64, a->len) != 0) {
+			printf("Error: cannot allocate %#x bytes\n", a->len);
+			return 0;
+		}
+		bar_read_wide(dev, a->addr, live, a->len);
+		new = live;
+	}
+
+	t = now_ns();
+	n = a->len / 4;
+	for (i = diff_next(old, new, 0, n); i < n; i = diff_next(old, new, i + 1, n)) {
+		o = old[i];
+		v = new[i];
+		if (big_endian) {
+			o = bswap_32(o);
+			v = bswap_32(v);
+		}
+		printf("%.8X: %.8X -> %.8X  changed %.8X  set %.8X  cleared %.8X\n",
+			a->addr + 4*i, o, v, o ^ v, ~o & v, o & ~v);
+		changed++;
+	}
+	t = now_ns() - t;
+	printf("%u of %u words changed (%.3f ms)\n", changed, n, t / 1e6);
+	free(live);
+	return 0;
+}
+
+/* ----------------------------------------------------------------
+ * Pattern search
+ * ----------------------------------------------------------------
+ *
+ * find scans a BAR window (read once with wide accesses) or a
+ * region of boot_buffer for a 1/2/4/8-byte value, optionally under
+ * a mask, or for a byte sequence, and prints every hit offset.
+ * Values are matched at naturally aligned offsets in the current
+ * endian mode; sequences match at any byte offset.
+ */
+typedef struct {
+	unsigned int  base;        /* address printed for offset 0 */
+	uint32_t      hits;
+} find_ctx_t;
+
+static void find_hit(find_ctx_t *ctx, uint32_t off)
+{
+	if ((ctx->hits % 8) == 0) {
+		printf("%s", ctx->hits ? "\n" : "");
+	}
+	printf(" %.8X", ctx->base + off);
+	ctx->hits++;
+}
+
+static int find_match(const unsigned char *p, int width, uint64_t value, uint64_t mask)
+{
+	uint64_t v = 0;
+
+	memcpy(&v, p, width);
+	return (v & mask) == value;
+}
+
+/* Report the matching elements of one vector; m has one bit per
+ * byte and an element matches when all of its width bits are set.
+ */
+static void find_report_mask(find_ctx_t *ctx, uint32_t off, uint32_t m, int width)
+{
+	uint32_t wmask = (width == 4) ? 0xf : (width == 8) ? 0xff : (1u << width) - 1;
+	int e;
+
+	while (m) {
+		e = (__builtin_ctz(m) / width) * width;
+		if (((m >> e) & wmask) == wmask) {
+			find_hit(ctx, off + e);
+		}
+		m &= ~(wmask << e);
+	}
+}
+
+static uint32_t find_value_generic(find_ctx_t *ctx, const unsigned char *buf,
+	uint32_t i, uint32_t len, int width, uint64_t value, uint64_t mask)
+{
+	for (; i + width <= len; i += width) {
+		if (find_match(buf + i, width, value, mask)) {
+			find_hit(ctx, i);
+		}
+	}
+	return i;
+}
+
+#if defined(__x86_64__)
+static __m128i find_cmpeq_sse2(__m128i a, __m128i b, int width)
+{
+	switch (width) {
+		case 1:  return _mm_cmpeq_epi8(a, b);
+		case 2:  return _mm_cmpeq_epi16(a, b);
+		/* 8-byte elements need both halves, checked by find_report_mask */
+		default: return _mm_cmpeq_epi32(a, b);
+	}
+}
+
+static uint32_t find_value_sse2(find_ctx_t *ctx, const unsigned char *buf,
+	uint32_t len, int width, uint64_t value, uint64_t mask)
+{
+	__m128i vv = _mm_set1_epi64x(value);
+	__m128i vm = _mm_set1_epi64x(mask);
+	__m128i d;
+	uint32_t i, m;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		d = _mm_and_si128(_mm_loadu_si128((const __m128i *)(buf + i)), vm);
+		m = _mm_movemask_epi8(find_cmpeq_sse2(d, vv, width));
+		if (m) {
+			find_report_mask(ctx, i, m, width);
+		}
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static uint32_t find_value_avx2(find_ctx_t *ctx, const unsigned char *buf,
+	uint32_t len, int width, uint64_t value, uint64_t mask)
+{
+	__m256i vv = _mm256_set1_epi64x(value);
+	__m256i vm = _mm256_set1_epi64x(mask);
+	__m256i d, eq;
+	uint32_t i, m;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		d = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(buf + i)), vm);
+		switch (width) {
+			case 1:  eq = _mm256_cmpeq_epi8(d, vv); break;
+			case 2:  eq = _mm256_cmpeq_epi16(d, vv); break;
+			case 4:  eq = _mm256_cmpeq_epi32(d, vv); break;
+			default: eq = _mm256_cmpeq_epi64(d, vv); break;
+		}
+		m = _mm256_movemask_epi8(eq);
+		if (m) {
+			find_report_mask(ctx, i, m, width);
+		}
+	}
+	return i;
+}
+
+/* Candidates are positions where both the first and the last byte
+ * of the sequence match; only those are compared in full.
+ */
+__attribute__((target("avx2")))
+static uint32_t find_seq_avx2(find_ctx_t *ctx, const unsigned char *buf,
+	uint32_t len, const unsigned char *seq, uint32_t n)
+{
+	__m256i first = _mm256_set1_epi8(seq[0]);
+	__m256i last = _mm256_set1_epi8(seq[n - 1]);
+	__m256i a, b;
+	uint32_t i, m;
+	int bit;
+
+	for (i = 0; i + n - 1 + 32 <= len; i += 32) {
+		a = _mm256_cmpeq_epi8(first, _mm256_loadu_si256((const __m256i *)(buf + i)));
+		b = _mm256_cmpeq_epi8(last, _mm256_loadu_si256((const __m256i *)(buf + i + n - 1)));
+		m = _mm256_movemask_epi8(_mm256_and_si256(a, b));
+		while (m) {
+			bit = __builtin_ctz(m);
+			if (memcmp(buf + i + bit + 1, seq + 1, n > 2 ? n - 2 : 0) == 0) {
+				find_hit(ctx, i + bit);
+			}
+			m &= m - 1;
+		}
+	}
+	return i;
+}
+
+static uint32_t find_seq_sse2(find_ctx_t *ctx, const unsigned char *buf,
+	uint32_t len, const unsigned char *seq, uint32_t n)
+{
+	__m128i first = _mm_set1_epi8(seq[0]);
+	__m128i last = _mm_set1_epi8(seq[n - 1]);
+	__m128i a, b;
+	uint32_t i, m;
+	int bit;
+
+	for (i = 0; i + n - 1 + 16 <= len; i += 16) {
+		a = _mm_cmpeq_epi8(first, _mm_loadu_si128((const __m128i *)(buf + i)));
+		b = _mm_cmpeq_epi8(last, _mm_loadu_si128((const __m128i *)(buf + i + n - 1)));
+		m = _mm_movemask_epi8(_mm_and_si128(a, b));
+		while (m) {
+			bit = __builtin_ctz(m);
+			if (memcmp(buf + i + bit + 1, seq + 1, n > 2 ? n - 2 : 0) == 0) {
+				find_hit(ctx, i + bit);
+			}
+			m &= m - 1;
+		}
+	}
+	return i;
+}
+#endif
+
+static void find_value(find_ctx_t *ctx, const unsigned char *buf, uint32_t len,
+	int width, uint64_t value, uint64_t mask)
+{
+	uint32_t i = 0;
+#if defined(__x86_64__)
+	/* Replicate the element across a 64-bit lane for the vector compares */
+	uint64_t rep = (width == 1) ? 0x0101010101010101ull :
+		(width == 2) ? 0x0001000100010001ull :
+		(width == 4) ? 0x0000000100000001ull : 1;
+
+	if (__builtin_cpu_supports("avx2")) {
+		i = find_value_avx2(ctx, buf, len, width, value * rep, mask * rep);
+	} else {
+		i = find_value_sse2(ctx, buf, len, width, value * rep, mask * rep);
+	}
+#endif
+	find_value_generic(ctx, buf, i, len, width, value, mask);
+}
+
+static void find_seq(find_ctx_t *ctx, const unsigned char *buf, uint32_t len,
+	const unsigned char *seq, uint32_t n)
+{
+	uint32_t i = 0;
+
+	if (n > len) {
+		return;
+	}
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("avx2")) {
+		i = find_seq_avx2(ctx, buf, len, seq, n);
+	} else {
+		i = find_seq_sse2(ctx, buf, len, seq, n);
+	}
+#endif
+	for (; i + n <= len; i++) {
+		if (memcmp(buf + i, seq, n) == 0) {
+			find_hit(ctx, i);
+		}
+	}
+}
+
+/* Parse a hex byte string such as "deadbeef0102" */
+static int parse_hex_bytes(const char *str, unsigned char *out, int max)
+{
+	unsigned int byte;
+	int n = 0;
+
+	while (str[0] && str[1] && (n < max)) {
+		if (sscanf(str, "%2x", &byte) != 1) {
+			return -1;
+		}
+		out[n++] = byte;
+		str += 2;
+	}
+	return (str[0] == '\0') ? n : -1;
+}
+
+int find_mem(device_t *dev, char *cmd)
+{
+	char region[8], kind[8], arg[130];
+	unsigned int addr = 0;
+	uint32_t len = 0;
+	unsigned long long value = 0, mask = ~0ull;
+	unsigned char seq[64];
+	unsigned char *buf, *copy = NULL;
+	find_ctx_t ctx;
+	int width = 0, n = 0;
+	int status;
+	uint64_t t;
+
+	status = sscanf(cmd, "%*s %7s %x %x %7s %129s %llx", region, &addr, &len,
+			kind, arg, &mask);
+	if (status < 5) {
+		printf("Syntax error (use ? for help)\n");
+		return 0;
+	}
+	if (kind[0] == 's') {
+		n = parse_hex_bytes(arg, seq, sizeof(seq));
+		if (n <= 0) {
+			printf("Syntax error (use ? for help)\n");
+			return 0;
+		}
+	} else {
+		width = atoi(kind);
+		if (((width != 1) && (width != 2) && (width != 4) && (width != 8)) ||
+		    (sscanf(arg, "%llx", &value) != 1)) {
+			printf("Syntax error (use ? for help)\n");
+			return 0;
+		}
+		if (width < 8) {
+			mask &= (1ull << (8 * width)) - 1;
+		}
+		if (big_endian && (width > 1)) {
+			value = bswap_64(value) >> (64 - 8 * width);
+			mask = bswap_64(mask) >> (64 - 8 * width);
+		}
+		value &= mask;
+	}
+
+	if (strcmp(region, "bar") == 0) {
+		if ((addr & 3) || (len & 3) || (addr > dev->size) || (len > dev->size - addr)) {
+			printf("Error: invalid BAR window (maximum allowed is %.8X)\n", dev->size);
+			return 0;
+		}
+		if (posix_memalign((void **)&copy, 64, len) != 0) {
+			printf("Error: cannot allocate %#x bytes\n", len);
+			return 0;
+		}
+		bar_read_wide(dev, addr, copy, len);
+		buf = copy;
+	} else if (strcmp(region, "buf") == 0) {
+		if (dma_prepare() < 0) {
+			return 0;
+		}
+		if ((addr > BOOT_BUFFER_SIZE) || (len > BOOT_BUFFER_SIZE - addr)) {
+			printf("Error: invalid buffer window (maximum allowed is %.8X)\n",
+				BOOT_BUFFER_SIZE);
+			return 0;
+		}
+		buf = boot_buffer + addr;
+	} else {
+		printf("Syntax error (use ? for help)\n");
+		return 0;
+	}
+
+	ctx.base = addr;
+	ctx.hits = 0;
+	t = now_ns();
+	if (n > 0) {
+		find_seq(&ctx, buf, len, seq, n);
+	} else {
+		/* Keep values aligned to their width relative to addr */
+		find_value(&ctx, buf, len - (len % width), width, value, mask);
+	}
+	t = now_ns() - t;
+	printf("%s%u hits in %#x bytes (%.3f ms)\n", ctx.hits ? "\n" : "",
+		ctx.hits, len, t / 1e6);
+	free(copy);
+	return 0;
+}
+
+/* ----------------------------------------------------------------
+ * Specialized MMIO kernels
+ * ----------------------------------------------------------------
+ *
+ * fill_mem() and display_mem() pick one kernel per command from
+ * mmio_kernels[width][endian] instead of testing big_endian and the
+ * width for every element. Each kernel is generated with the element
+ * width and byte order as compile-time constants:
+ *
+ *  - values are produced a block at a time in host memory and byte
+ *    swapped in bulk (SSSE3 shuffles) when the mode needs it;
+ *  - the BAR is accessed with unrolled volatile loads and stores of
+ *    exactly the element width, which is the widest access the user
+ *    allowed: d8 issues byte reads and only d64/f64 use 64-bit
+ *    accesses, so registers that decode byte enables or only accept
+ *    32-bit accesses see the same transactions as before.
+ *
+ * Unlike write_le32(), the kernels do not sleep between stores and
+ * msync() once per command rather than once per element.
+ */
+#define MMIO_BLOCK          512
+
+
+#if defined(__x86_64__)
+__attribute__((target("ssse3")))
+static uint32_t mmio_swap_ssse3(unsigned char *buf, uint32_t bytes, int width)
+{
+	__m128i mask;
+	uint32_t i;
+
+	switch (width) {
+		case 2:
+			mask = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+			break;
+		case 4:
+			mask = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+			break;
+		default:
+			mask = _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+			break;
+	}
+	for (i = 0; i + 16 <= bytes; i += 16) {
+		_mm_storeu_si128((__m128i *)(buf + i),
+			_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(buf + i)), mask));
+	}
+	return i;
+}
+#endif
+
+/* Byte swap every width-byte element of buf */
+static inline __attribute__((always_inline))
+void mmio_swap(void *buf, uint32_t bytes, int width)
+{
+	unsigned char *p = buf;
+	uint32_t i = 0;
+
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("ssse3")) {
+		i = mmio_swap_ssse3(p, bytes, width);
+	}
+#endif
+	/* Tail, reversing the bytes of each element */
+	for (; i < bytes; i += width) {
+		unsigned char *e = p + i;
+		int a, b;
+		unsigned char t;
+
+		for (a = 0, b = width - 1; a < b; a++, b--) {
+			t = e[a];
+			e[a] = e[b];
+			e[b] = t;
+		}
+	}
+}
+
+/* One element of the given width, through a volatile pointer. The
+ * host side goes through memcpy() as the host buffer may not be
+ * aligned for the element type.
+ */
+static inline __attribute__((always_inline))
+void mmio_put(unsigned char *dst, const unsigned char *src, int width)
+{
+	uint16_t v16;
+	uint32_t v32;
+	uint64_t v64;
+
+	switch (width) {
+		case 1:  *(volatile uint8_t *)dst = *src; break;
+		case 2:  memcpy(&v16, src, 2); *(volatile uint16_t *)dst = v16; break;
+		case 4:  memcpy(&v32, src, 4); *(volatile uint32_t *)dst = v32; break;
+		default: memcpy(&v64, src, 8); *(volatile uint64_t *)dst = v64; break;
+	}
+}
+
+static inline __attribute__((always_inline))
+void mmio_get(unsigned char *dst, const unsigned char *src, int width)
+{
+	uint16_t v16;
+	uint32_t v32;
+	uint64_t v64;
+
+	switch (width) {
+		case 1:  *dst = *(volatile uint8_t *)src; break;
+		case 2:  v16 = *(volatile uint16_t *)src; memcpy(dst, &v16, 2); break;
+		case 4:  v32 = *(volatile uint32_t *)src; memcpy(dst, &v32, 4); break;
+		default: v64 = *(volatile uint64_t *)src; memcpy(dst, &v64, 8); break;
+	}
+}
+
+/* Copy bytes of width-sized elements from host memory to the BAR */
+static inline __attribute__((always_inline))
+void mmio_store(unsigned char *dst, const unsigned char *src, uint32_t bytes, int width)
+{
+	uint32_t i = 0;
+
+	for (; i + 4 * width <= bytes; i += 4 * width) {
+		mmio_put(dst + i, src + i, width);
+		mmio_put(dst + i + width, src + i + width, width);
+		mmio_put(dst + i + 2 * width, src + i + 2 * width, width);
+		mmio_put(dst + i + 3 * width, src + i + 3 * width, width);
+	}
+	for (; i < bytes; i += width) {
+		mmio_put(dst + i, src + i, width);
+	}
+}
+
+/* Copy bytes of width-sized elements from the BAR to host memory */
+static inline __attribute__((always_inline))
+void mmio_load(unsigned char *dst, const unsigned char *src, uint32_t bytes, int width)
+{
+	uint32_t i = 0;
+
+	for (; i + 4 * width <= bytes; i += 4 * width) {
+		mmio_get(dst + i, src + i, width);
+		mmio_get(dst + i + width, src + i + width, width);
+		mmio_get(dst + i + 2 * width, src + i + 2 * width, width);
+		mmio_get(dst + i + 3 * width, src + i + 3 * width, width);
+	}
+	for (; i < bytes; i += width) {
+		mmio_get(dst + i, src + i, width);
+	}
+}
+
+/* Byte order of the target relative to the host */
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#define MMIO_SWAP_le        0
+#define MMIO_SWAP_be        1
+#else
+#define MMIO_SWAP_le        1
+#define MMIO_SWAP_be        0
+#endif
+
+#define MMIO_KERNELS(bits, order)                                              \
+static void mmio_fill_##bits##_##order(device_t *dev, unsigned int addr,       \
+	uint32_t count, uint64_t val, uint32_t inc)                            \
+{                                                                              \
+	uint##bits##_t tmp[MMIO_BLOCK];                                        \
+	uint32_t done, n, i;                                                   \
+                                                                               \
+	for (done = 0; done < count; done += n) {                              \
+		n = (count - done < MMIO_BLOCK) ? count - done : MMIO_BLOCK;   \
+		for (i = 0; i < n; i++) {                                      \
+			tmp[i] = (uint##bits##_t)(val + (uint64_t)(done + i) * inc); \
+		}                                                              \
+		if ((bits > 8) && MMIO_SWAP_##order) {                         \
+			mmio_swap(tmp, n * (bits / 8), bits / 8);              \
+		}                                                              \
+		mmio_store(dev->addr + addr + done * (bits / 8),               \
+			(const unsigned char *)tmp, n * (bits / 8), bits / 8); \
+		if (rec_fp != NULL) {                                          \
+			rec_data(REC_WRITE_BLOCK, bits / 8,                    \
+				addr + done * (bits / 8), tmp, n * (bits / 8)); \
+		}                                                              \
+	}                                                                      \
+	msync((void *)(dev->addr + addr), count * (bits / 8),                  \
+		MS_SYNC | MS_INVALIDATE);                                      \
+}                                                                              \
+                                                                               \
+static void mmio_read_##bits##_##order(device_t *dev, unsigned int addr,       \
+	void *buf, uint32_t count)                                             \
+{                                                                              \
+	mmio_load(buf, dev->addr + addr, count * (bits / 8), bits / 8);        \
+	if (rec_fp != NULL) {                                                  \
+		rec_data(REC_READ_BLOCK, bits / 8, addr, buf, count * (bits / 8)); \
+	}                                                                      \
+	if ((bits > 8) && MMIO_SWAP_##order) {                                 \
+		mmio_swap(buf, count * (bits / 8), bits / 8);                  \
+	}                                                                      \
+}                                                                              \
+                                                                               \
+static void mmio_write_##bits##_##order(device_t *dev, unsigned int addr,      \
+	const void *buf, uint32_t count)                                       \
+{                                                                              \
+	uint##bits##_t tmp[MMIO_BLOCK];                                        \
+	uint32_t done, n;                                                      \
+                                                                               \
+	for (done = 0; done < count; done += n) {                              \
+		n = (count - done < MMIO_BLOCK) ? count - done : MMIO_BLOCK;   \
+		memcpy(tmp, buf + done * (bits / 8), n * (bits / 8));          \
+		if ((bits > 8) && MMIO_SWAP_##order) {                         \
+			mmio_swap(tmp, n * (bits / 8), bits / 8);              \
+		}                                                              \
+		mmio_store(dev->addr + addr + done * (bits / 8),               \
+			(const unsigned char *)tmp, n * (bits / 8), bits / 8); \
+		if (rec_fp != NULL) {                                          \
+			rec_data(REC_WRITE_BLOCK, bits / 8,                    \
+				addr + done * (bits / 8), tmp, n * (bits / 8)); \
+		}                                                              \
+	}                                                                      \
+	msync((void *)(dev->addr + addr), count * (bits / 8),                  \
+		MS_SYNC | MS_INVALIDATE);                                      \
+}
+
+MMIO_KERNELS(8, le)
+MMIO_KERNELS(16, le)
+MMIO_KERNELS(16, be)
+MMIO_KERNELS(32, le)
+MMIO_KERNELS(32, be)
+MMIO_KERNELS(64, le)
+MMIO_KERNELS(64, be)
+
+/* Indexed by [log2(width / 8)][big_endian] */
+#define MMIO_KERNEL(bits, order) \
+	{ mmio_fill_##bits##_##order, mmio_read_##bits##_##order, mmio_write_##bits##_##order }
+
+static const mmio_kernel_t mmio_kernels[4][2] = {
+	{ MMIO_KERNEL(8, le),  MMIO_KERNEL(8, le)  },
+	{ MMIO_KERNEL(16, le), MMIO_KERNEL(16, be) },
+	{ MMIO_KERNEL(32, le), MMIO_KERNEL(32, be) },
+	{ MMIO_KERNEL(64, le), MMIO_KERNEL(64, be) },
+};
+
+/* Kernel for an access width in bits, NULL if unsupported */
+const mmio_kernel_t *mmio_kernel_select(int width)
+{
+	switch (width) {
+		case 8:  return &mmio_kernels[0][big_endian != 0];
+		case 16: return &mmio_kernels[1][big_endian != 0];
+		case 32: return &mmio_kernels[2][big_endian != 0];
+		case 64: return &mmio_kernels[3][big_endian != 0];
+		default: return NULL;
+	}
+}
+
+/* ----------------------------------------------------------------
+ * Daemon mode
+ * ----------------------------------------------------------------
+ *
+ * With -D <socket> the tool keeps the BAR and udmabuf0 mappings open
+ * and serves clients on a Unix stream socket, one thread per client.
+ * Register reads and writes and command lines run one at a time under
+ * device_lock; DMA requests claim their channel like background jobs
+ * do.
+ *
+ * Command output is captured by redirecting stdout for the whole
+ * process, so anything a background job or ring thread prints while
+ * a client command runs goes to that client instead of the daemon's
+ * own output.
+ *
+ * A connection that starts with DAEMON_MAGIC speaks the binary
+ * protocol: a daemon_req_t header (plus payload for writes, DMA to
+ * the endpoint and commands) answered by a daemon_rsp_t header (plus
+ * payload for reads, DMA from the endpoint and command output). Any
+ * other connection is line based: each line is run as an interactive
+ * command and its output is returned, followed by the prompt. This
+ * works with e.g. "socat - UNIX-CONNECT:<socket>".
+ */
+#define DAEMON_MAGIC        0x44494350      /* "PCID" */
+#define DAEMON_MAX_LEN      0x100000
+
+enum {
+	DAEMON_OP_READ = 1,        /* read len bytes at BAR addr */
+	DAEMON_OP_WRITE,           /* write payload at BAR addr */
+	DAEMON_OP_DMA_TO_EP,       /* DMA payload to endpoint address addr */
+	DAEMON_OP_DMA_FROM_EP,     /* DMA len bytes from endpoint address addr */
+	DAEMON_OP_CMD              /* run payload as a command line */
+};
+
+typedef struct {
+	uint32_t magic;
+	uint16_t op;
+	uint16_t width;            /* access width in bits for READ/WRITE */
+	uint32_t addr;
+	uint32_t len;
+} daemon_req_t;
+
+typedef struct {
+	uint32_t magic;
+	int32_t  status;           /* 0 or -errno */
+	uint32_t len;              /* payload bytes that follow */
+} daemon_rsp_t;
+
+typedef struct {
+	device_t *dev;
+	int       fd;
+} daemon_client_t;
+
+static pthread_mutex_t device_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int daemon_recv(int fd, void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = recv(fd, buf, len, 0);
+		if (n <= 0) {
+			if ((n < 0) && (errno == EINTR)) {
+				continue;
+			}
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int daemon_send(int fd, const void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n <= 0) {
+			if ((n < 0) && (errno == EINTR)) {
+				continue;
+			}
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Commands that loop until stopped, only usable as background jobs */
+static int daemon_never_returns(const char *line)
+{
+	return line[0] == '2';
+}
+
+/* Run one command line with stdout captured into a buffer. Must be
+ * called with device_lock held, as stdout is redirected process wide.
+ */
+static int daemon_run_command(device_t *dev, char *line, char **out, uint32_t *out_len)
+{
+	int saved, mfd;
+	int status;
+	off_t size;
+
+	*out = NULL;
+	*out_len = 0;
+	mfd = memfd_create("pci_debug", 0);
+	if (mfd < 0) {
+		return -errno;
+	}
+	fflush(stdout);
+	saved = dup(STDOUT_FILENO);
+	dup2(mfd, STDOUT_FILENO);
+	if (daemon_never_returns(line)) {
+		/* Would hold the client thread (and device_lock) for good */
+		printf("'%c' never returns; use 'bg %c' in daemon sessions\n", line[0], line[0]);
+		status = 0;
+	} else {
+		status = process_command(dev, line);
+	}
+	fflush(stdout);
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+
+	size = lseek(mfd, 0, SEEK_END);
+	if ((size > 0) && ((*out = malloc(size)) != NULL)) {
+		if (pread(mfd, *out, size, 0) == size) {
+			*out_len = size;
+		}
+	}
+	close(mfd);
+	return status;
+}
+
+static int daemon_binary_request(daemon_client_t *client, daemon_req_t *req)
+{
+	device_t *dev = client->dev;
+	daemon_rsp_t rsp = { DAEMON_MAGIC, 0, 0 };
+	const mmio_kernel_t *kernel = NULL;
+	unsigned char *buf = NULL;
+	char *out = NULL;
+	int cmd_status;
+	int chan;
+
+	if (req->len > DAEMON_MAX_LEN) {
+		rsp.status = -EINVAL;
+		return daemon_send(client->fd, &rsp, sizeof(rsp));
+	}
+	buf = malloc(req->len + 1);
+	if (buf == NULL) {
+		rsp.status = -ENOMEM;
+		return daemon_send(client->fd, &rsp, sizeof(rsp));
+	}
+	if ((req->op == DAEMON_OP_WRITE) || (req->op == DAEMON_OP_DMA_TO_EP) ||
+	    (req->op == DAEMON_OP_CMD)) {
+		if (daemon_recv(client->fd, buf, req->len) < 0) {
+			free(buf);
+			return -1;
+		}
+	}
+
+	switch (req->op) {
+		case DAEMON_OP_READ:
+		case DAEMON_OP_WRITE:
+			kernel = mmio_kernel_select(req->width);
+			if ((kernel == NULL) || (req->addr > dev->size) ||
+			    (req->len > dev->size - req->addr) || (req->len % (req->width / 8))) {
+				rsp.status = -EINVAL;
+				break;
+			}
+			/* Not while a command has the BAR pointed elsewhere */
+			pthread_mutex_lock(&device_lock);
+			if (req->op == DAEMON_OP_READ) {
+				kernel->read(dev, req->addr, buf, req->len / (req->width / 8));
+				rsp.len = req->len;
+			} else {
+				kernel->write(dev, req->addr, buf, req->len / (req->width / 8));
+			}
+			pthread_mutex_unlock(&device_lock);
+			break;
+		case DAEMON_OP_DMA_TO_EP:
+		case DAEMON_OP_DMA_FROM_EP:
+			if ((req->len == 0) || (req->len > RING_AREA_SIZE)) {
+				rsp.status = -EINVAL;
+				break;
+			}
+			if (dma_prepare() < 0) {
+				rsp.status = -ENODEV;
+				break;
+			}
+			chan = (req->op == DAEMON_OP_DMA_TO_EP) ? DMA_CHAN_WR : DMA_CHAN_RD;
+			dma_claim(chan, 1);
+			if (req->op == DAEMON_OP_DMA_TO_EP) {
+				memcpy(boot_buffer + RING_SRC_OFF, buf, req->len);
+				if (dma_single(dev, 1, phys_addr + RING_SRC_OFF, req->addr, req->len) == 0) {
+					rsp.status = -ETIMEDOUT;
+				}
+			} else {
+				if (dma_single(dev, 0, phys_addr + RING_DST_OFF, req->addr, req->len) == 0) {
+					rsp.status = -ETIMEDOUT;
+				} else {
+					memcpy(buf, boot_buffer + RING_DST_OFF, req->len);
+					rsp.len = req->len;
+				}
+			}
+			dma_release(chan);
+			break;
+		case DAEMON_OP_CMD:
+			buf[req->len] = '\0';
+			pthread_mutex_lock(&device_lock);
+			cmd_status = daemon_run_command(dev, (char *)buf, &out, &rsp.len);
+			pthread_mutex_unlock(&device_lock);
+			rsp.status = (cmd_status < 0) ? cmd_status : 0;
+			free(buf);
+			buf = (unsigned char *)out;
+			break;
+		default:
+			rsp.status = -EOPNOTSUPP;
+			break;
+	}
+
+	if ((daemon_send(client->fd, &rsp, sizeof(rsp)) < 0) ||
+	    (rsp.len && (daemon_send(client->fd, buf, rsp.len) < 0))) {
+		free(buf);
+		return -1;
+	}
+	free(buf);
+	return 0;
+}
+
+static void daemon_text_session(daemon_client_t *client)
+{
+	char line[1024];
+	char *out;
+	uint32_t out_len;
+	size_t used = 0;
+	ssize_t n;
+	char *nl;
+	int status;
+
+	daemon_send(client->fd, "PCI> ", 5);
+	while (1) {
+		nl = memchr(line, '\n', used);
+		if (nl == NULL) {
+			if (used == sizeof(line) - 1) {
+				/* Over-long line, drop it */
+				used = 0;
+			}
+			n = recv(client->fd, line + used, sizeof(line) - 1 - used, 0);
+			if (n <= 0) {
+				return;
+			}
+			used += n;
+			continue;
+		}
+		*nl = '\0';
+		if ((nl > line) && (nl[-1] == '\r')) {
+			nl[-1] = '\0';
+		}
+		status = 0;
+		if (line[0] != '\0') {
+			pthread_mutex_lock(&device_lock);
+			status = daemon_run_command(client->dev, line, &out, &out_len);
+			pthread_mutex_unlock(&device_lock);
+			if (out_len) {
+				daemon_send(client->fd, out, out_len);
+			}
+			free(out);
+		}
+		if (status < 0) {
+			return;
+		}
+		used -= (nl + 1) - line;
+		memmove(line, nl + 1, used);
+		daemon_send(client->fd, "PCI> ", 5);
+	}
+}
+
+static void *daemon_client(void *arg)
+{
+	daemon_client_t *client = arg;
+	daemon_req_t req;
+	uint32_t magic = 0;
+
+	if ((recv(client->fd, &magic, sizeof(magic), MSG_PEEK | MSG_WAITALL) == sizeof(magic)) &&
+	    (magic == DAEMON_MAGIC)) {
+		while (daemon_recv(client->fd, &req, sizeof(req)) == 0) {
+			if ((req.magic != DAEMON_MAGIC) ||
+			    (daemon_binary_request(client, &req) < 0)) {
+				break;
+			}
+		}
+	} else {
+		daemon_text_session(client);
+	}
+	close(client->fd);
+	free(client);
+	return NULL;
+}
+
+int daemon_serve(device_t *dev, const char *path)
+{
+	struct sockaddr_un sa;
+	daemon_client_t *client;
+	struct stat st;
+	pthread_t thread;
+	int lfd, fd;
+
+	lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (lfd < 0) {
+		printf("socket() failed: errno %d, %s\n", errno, strerror(errno));
+		return -1;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", path);
+	/* Only replace a stale socket, never some other file */
+	if (lstat(path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			printf("Error: '%s' exists and is not a socket\n", path);
+			close(lfd);
+			return -1;
+		}
+		unlink(path);
+	}
+	if ((bind(lfd, (struct sockaddr *)&sa, sizeof(sa)) < 0) || (listen(lfd, 16) < 0)) {
+		printf("Cannot listen on '%s': errno %d, %s\n", path, errno, strerror(errno));
+		close(lfd);
+		return -1;
+	}
+	printf(" - serving on %s\n", path);
+	fflush(stdout);
+
+	while (1) {
+		fd = accept(lfd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			printf("accept() failed: errno %d, %s\n", errno, strerror(errno));
+			break;
+		}
+		client = malloc(sizeof(*client));
+		if (client == NULL) {
+			close(fd);
+			continue;
+		}
+		client->dev = dev;
+		client->fd = fd;
+		if (pthread_create(&thread, NULL, daemon_client, client) != 0) {
+			close(fd);
+			free(client);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	close(lfd);
+	unlink(path);
+	return -1;
+}
+
+/* ----------------------------------------------------------------
+ * Session record and replay
+ * ----------------------------------------------------------------
+ *
+ * While recording, every command line, setpci call and MMIO access
+ * is appended to a binary log as a rec_entry_t, timestamped relative
+ * to the previous entry. Commands, setpci arguments and block
+ * accesses carry their text or data after the entry. Values are
+ * logged as they appear on the bus, independent of the endian mode,
+ * and runs of identical reads (status polling) are folded into one
+ * entry with a repeat count.
+ *
+ * Replay re-issues the setpci calls and MMIO accesses at the
+ * recorded pace or as fast as possible. With verify, each read is
+ * compared with the recorded value. A read of a register that was
+ * just polled is itself treated as a poll: it is retried until the
+ * recorded value appears or one second passes. Block reads use the
+ * recorded access width. setpci entries are run without a shell and
+ * only in the "setpci -s <bdf> <reg>=<val>[:<mask>]" form. udmabuf0
+ * contents are not part of the log.
+ *
+ * A log that writes the DMA LLP or doorbell registers holds both
+ * channels for the whole replay, like '1' and '2' do, and the one-shot
+ * chains are copied back into udmabuf0 before each replayed doorbell
+ * so the engine never walks stale descriptors.
+ */
+#define REC_MAGIC           0x52494350      /* "PCIR" */
+#define REC_VERSION         1
+
+typedef struct __attribute__((packed)) {
+	uint8_t  type;
+	uint8_t  width;            /* bytes per access */
+	uint16_t count;            /* number of identical reads */
+	uint32_t delta_us;         /* time since the previous entry */
+	uint32_t addr;             /* BAR offset */
+	uint64_t value;            /* access value, or length of what follows */
+} rec_entry_t;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t bar;
+	uint32_t reserved;
+} rec_header_t;
+
+static pthread_mutex_t rec_lock = PTHREAD_MUTEX_INITIALIZER;
+static rec_entry_t rec_pending;    /* read run not yet written */
+static uint64_t rec_last_ns;
+static uint64_t rec_entries;
+
+static uint32_t rec_delta(void)
+{
+	uint64_t now = now_ns();
+	uint64_t delta = (now - rec_last_ns) / 1000;
+
+	rec_last_ns = now;
+	return (delta > 0xffffffffull) ? 0xffffffffu : delta;
+}
+
+static void rec_flush_pending(void)
+{
+	if (rec_pending.type != 0) {
+		fwrite(&rec_pending, sizeof(rec_pending), 1, rec_fp);
+		rec_entries++;
+		rec_pending.type = 0;
+	}
+}
+
+void rec_access(int type, int width, unsigned int addr, uint64_t value)
+{
+	rec_entry_t e;
+
+	pthread_mutex_lock(&rec_lock);
+	if (rec_fp == NULL) {
+		pthread_mutex_unlock(&rec_lock);
+		return;
+	}
+	if ((type == REC_READ) && (rec_pending.type == REC_READ) &&
+	    (rec_pending.addr == addr) && (rec_pending.width == width) &&
+	    (rec_pending.value == value) && (rec_pending.count < 0xffff)) {
+		rec_pending.count++;
+		rec_last_ns = now_ns();
+		pthread_mutex_unlock(&rec_lock);
+		return;
+	}
+	rec_flush_pending();
+	e.type = type;
+	e.width = width;
+	e.count = 1;
+	e.delta_us = rec_delta();
+	e.addr = addr;
+	e.value = value;
+	if (type == REC_READ) {
+		rec_pending = e;
+	} else {
+		fwrite(&e, sizeof(e), 1, rec_fp);
+		rec_entries++;
+	}
+	pthread_mutex_unlock(&rec_lock);
+}
+
+/* Entry followed by len bytes of text or data */
+void rec_data(int type, int width, unsigned int addr, const void *data, uint32_t len)
+{
+	rec_entry_t e;
+
+	pthread_mutex_lock(&rec_lock);
+	if (rec_fp == NULL) {
+		pthread_mutex_unlock(&rec_lock);
+		return;
+	}
+	rec_flush_pending();
+	e.type = type;
+	e.width = width;
+	e.count = 1;
+	e.delta_us = rec_delta();
+	e.addr = addr;
+	e.value = len;
+	fwrite(&e, sizeof(e), 1, rec_fp);
+	fwrite(data, 1, len, rec_fp);
+	rec_entries++;
+	pthread_mutex_unlock(&rec_lock);
+}
+
+int rec_start(device_t *dev, const char *path)
+{
+	rec_header_t hdr = { REC_MAGIC, REC_VERSION, dev->bar, 0 };
+	FILE *fp;
+
+	fp = fopen(path, "wb");
+	if (fp == NULL) {
+		printf("Open failed for file '%s': errno %d, %s\n", path, errno, strerror(errno));
+		return -1;
+	}
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	pthread_mutex_lock(&rec_lock);
+	rec_pending.type = 0;
+	rec_entries = 0;
+	rec_last_ns = now_ns();
+	rec_fp = fp;
+	pthread_mutex_unlock(&rec_lock);
+	return 0;
+}
+
+void rec_stop(void)
+{
+	pthread_mutex_lock(&rec_lock);
+	if (rec_fp != NULL) {
+		rec_flush_pending();
+		fclose(rec_fp);
+		rec_fp = NULL;
+		printf("recorded %llu entries\n", (unsigned long long)rec_entries);
+	}
+	pthread_mutex_unlock(&rec_lock);
+}
+
+/* Skip hex digits; returns the first other character */
+static const char *setpci_hex(const char *p)
+{
+	const char *start = p;
+
+	p += strspn(p, "0123456789abcdefABCDEF");
+	return (p == start) ? NULL : p;
+}
+
+/* Run "setpci -s <bdf> <reg>[.b|.w|.l]=<val>[:<mask>]" directly,
+ * without a shell. Anything else is refused, since replayed command
+ * lines come from a file and the tool runs as root.
+ */
+static int setpci_exec(const char *cmdline)
+{
+	char line[128], *argv[5], *save = NULL;
+	const char *p;
+	unsigned int b, d, f;
+	int argc, status;
+	pid_t pid;
+
+	if (strlen(cmdline) >= sizeof(line)) {
+		return -1;
+	}
+	strcpy(line, cmdline);
+	for (argc = 0; argc < 5; argc++) {
+		argv[argc] = strtok_r(argc ? NULL : line, " \t", &save);
+		if (argv[argc] == NULL) {
+			break;
+		}
+	}
+	if ((argc != 4) || strcmp(argv[0], "setpci") || strcmp(argv[1], "-s") ||
+	    (argv[2][strspn(argv[2], "0123456789abcdefABCDEF:.")] != '\0') ||
+	    ((sscanf(argv[2], "%*x:%x:%x.%x", &b, &d, &f) != 3) &&
+	     (sscanf(argv[2], "%x:%x.%x", &b, &d, &f) != 3))) {
+		return -1;
+	}
+	p = setpci_hex(argv[3]);
+	if ((p != NULL) && (*p == '.')) {
+		p = ((p[1] == 'b') || (p[1] == 'w') || (p[1] == 'l')) ? p + 2 : NULL;
+	}
+	if ((p == NULL) || (*p != '=') || ((p = setpci_hex(p + 1)) == NULL)) {
+		return -1;
+	}
+	if ((*p == ':') && ((p = setpci_hex(p + 1)) == NULL)) {
+		return -1;
+	}
+	if (*p != '\0') {
+		return -1;
+	}
+
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0) {
+		return -1;
+	}
+	if (pid == 0) {
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+	return (WIFEXITED(status) && (WEXITSTATUS(status) == 0)) ? 0 : -1;
+}
+
+/* Run a setpci command line, logging it when recording */
+int run_setpci(const char *cmdline)
+{
+	if (rec_fp != NULL) {
+		rec_data(REC_SETPCI, 0, 0, cmdline, strlen(cmdline));
+	}
+	if (setpci_exec(cmdline) < 0) {
+		printf("setpci failed: %s\n", cmdline);
+		return -1;
+	}
+	return 0;
+}
+
+static uint64_t replay_get(device_t *dev, unsigned int addr, int width)
+{
+	switch (width) {
+		case 1:  return *(volatile uint8_t *)(dev->addr + addr);
+		case 2:  return *(volatile uint16_t *)(dev->addr + addr);
+		case 4:  return *(volatile uint32_t *)(dev->addr + addr);
+		default: return *(volatile uint64_t *)(dev->addr + addr);
+	}
+}
+
+static void replay_put(device_t *dev, unsigned int addr, int width, uint64_t value)
+{
+	switch (width) {
+		case 1:  *(volatile uint8_t *)(dev->addr + addr) = value; break;
+		case 2:  *(volatile uint16_t *)(dev->addr + addr) = value; break;
+		case 4:  *(volatile uint32_t *)(dev->addr + addr) = value; break;
+		default: *(volatile uint64_t *)(dev->addr + addr) = value; break;
+	}
+}
+
+/* Does a write of len bytes at addr touch the 32-bit register reg? */
+static int replay_hits(unsigned int addr, uint64_t len, unsigned int reg)
+{
+	return (addr < reg + 4) && (reg < addr + len);
+}
+
+static int replay_hits_doorbell(unsigned int addr, uint64_t len)
+{
+	return replay_hits(addr, len, DMA_RD_DOORBELL) ||
+		replay_hits(addr, len, DMA_WR_DOORBELL);
+}
+
+/* Scan the log for writes that start or redirect a DMA channel */
+static int replay_uses_dma(FILE *fp)
+{
+	rec_entry_t e;
+	long pos = ftell(fp);
+	int found = 0;
+
+	while (!found && (fread(&e, sizeof(e), 1, fp) == 1)) {
+		if ((e.type == REC_WRITE) || (e.type == REC_WRITE_BLOCK)) {
+			uint64_t len = (e.type == REC_WRITE) ? e.width : e.value;
+
+			found = replay_hits_doorbell(e.addr, len) ||
+				replay_hits(e.addr, len, DMA_RD_LLP) ||
+				replay_hits(e.addr, len, DMA_WR_LLP);
+		}
+		if (((e.type == REC_CMD) || (e.type == REC_SETPCI) ||
+		     (e.type == REC_WRITE_BLOCK) || (e.type == REC_READ_BLOCK)) &&
+		    (fseek(fp, e.value, SEEK_CUR) < 0)) {
+			break;
+		}
+	}
+	fseek(fp, pos, SEEK_SET);
+	return found;
+}
+
+int replay_session(device_t *dev, char *cmd)
+{
+	char path[256], opt1[16] = "", opt2[16] = "";
+	char context[128] = "(start)";
+	rec_header_t hdr;
+	rec_entry_t e;
+	unsigned char *data = NULL;
+	uint64_t when, start, now, got;
+	uint64_t n = 0, writes = 0, reads = 0, mismatches = 0;
+	unsigned int poll_addr = ~0u;
+	int fast, verify, dma;
+	int status, k;
+	FILE *fp;
+
+	status = sscanf(cmd, "%*s %255s %15s %15s", path, opt1, opt2);
+	if (status < 1) {
+		printf("Syntax error (use ? for help)\n");
+		return 0;
+	}
+	fast = !strcmp(opt1, "fast") || !strcmp(opt2, "fast");
+	verify = !strcmp(opt1, "verify") || !strcmp(opt2, "verify");
+
+	fp = fopen(path, "rb");
+	if (fp == NULL) {
+		printf("Open failed for file '%s': errno %d, %s\n", path, errno, strerror(errno));
+		return 0;
+	}
+	if ((fread(&hdr, sizeof(hdr), 1, fp) != 1) || (hdr.magic != REC_MAGIC) ||
+	    (hdr.version != REC_VERSION)) {
+		printf("Error: '%s' is not a session recording\n", path);
+		fclose(fp);
+		return 0;
+	}
+	if (hdr.bar != dev->bar) {
+		printf("Warning: recorded on BAR%u, replaying on BAR%u\n", hdr.bar, dev->bar);
+	}
+	dma = replay_uses_dma(fp);
+	if (dma && ((dma_prepare() < 0) || (dma_claim(DMA_CHAN_BOTH, 0) < 0))) {
+		fclose(fp);
+		return 0;
+	}
+
+	start = when = now_ns();
+	while (!job_stopping() && (fread(&e, sizeof(e), 1, fp) == 1)) {
+		n++;
+		job_count(1, 0, 0);
+		if ((e.type == REC_CMD) || (e.type == REC_SETPCI) ||
+		    (e.type == REC_WRITE_BLOCK) || (e.type == REC_READ_BLOCK)) {
+			free(data);
+			data = malloc(e.value + 1);
+			if ((data == NULL) || (fread(data, 1, e.value, fp) != e.value)) {
+				printf("Error: truncated entry %llu\n", (unsigned long long)n);
+				break;
+			}
+			data[e.value] = '\0';
+		}
+		if ((e.type != REC_CMD) && (e.type != REC_SETPCI) &&
+		    ((e.addr > dev->size) || (e.width == 0) ||
+		     (((e.type == REC_WRITE_BLOCK) || (e.type == REC_READ_BLOCK)) ?
+		      (e.value > dev->size - e.addr) : (e.width > dev->size - e.addr)))) {
+			printf("Error: entry %llu outside the BAR\n", (unsigned long long)n);
+			break;
+		}
+		if ((e.type != REC_CMD) && (e.type != REC_SETPCI) &&
+		    ((mmio_kernel_select(e.width * 8) == NULL) ||
+		     (((e.type == REC_WRITE_BLOCK) || (e.type == REC_READ_BLOCK)) &&
+		      (e.value % e.width)))) {
+			printf("Error: entry %llu has a bad access width\n", (unsigned long long)n);
+			break;
+		}
+
+		/* Keep the recorded pace against absolute deadlines */
+		when += (uint64_t)e.delta_us * 1000;
+		if (!fast) {
+			while ((now = now_ns()) < when) {
+				if (when - now > 100000) {
+					usleep((when - now) / 1000 - 50);
+				}
+			}
+		}
+
+		if (dma && ((e.type == REC_WRITE) || (e.type == REC_WRITE_BLOCK)) &&
+		    replay_hits_doorbell(e.addr, (e.type == REC_WRITE) ? e.width : e.value)) {
+			memcpy((void *)boot_buffer, desc, sizeof(desc));
+			__sync_synchronize();
+		}
+
+		switch (e.type) {
+			case REC_CMD:
+				snprintf(context, sizeof(context), "%s", data);
+				break;
+			case REC_SETPCI:
+				if (setpci_exec((char *)data) < 0) {
+					printf("entry %llu [%s]: setpci failed or refused: %.64s\n",
+						(unsigned long long)n, context, data);
+				}
+				break;
+			case REC_WRITE:
+				replay_put(dev, e.addr, e.width, e.value);
+				writes++;
+				poll_addr = ~0u;
+				break;
+			case REC_WRITE_BLOCK:
+				mmio_store(dev->addr + e.addr, data, e.value, e.width);
+				writes++;
+				poll_addr = ~0u;
+				break;
+			case REC_READ:
+				got = replay_get(dev, e.addr, e.width);
+				reads++;
+				if (e.count > 1) {
+					/* Polling: the iteration count depends on timing */
+					for (k = 1; (k < e.count) && (got == e.value); k++) {
+						got = replay_get(dev, e.addr, e.width);
+					}
+					poll_addr = e.addr;
+					break;
+				}
+				if (e.addr == poll_addr) {
+					while ((got != e.value) && (now_ns() - when < 1000000000ull)) {
+						got = replay_get(dev, e.addr, e.width);
+					}
+				}
+				poll_addr = ~0u;
+				if (verify && (got != e.value)) {
+					if (mismatches++ < 16) {
+						printf("entry %llu [%s]: read %.8X expected %llX got %llX\n",
+							(unsigned long long)n, context, e.addr,
+							(unsigned long long)e.value, (unsigned long long)got);
+					}
+				}
+				break;
+			case REC_READ_BLOCK:
+				{
+					unsigned char *live = malloc(e.value);
+
+					if (live == NULL) {
+						break;
+					}
+					mmio_load(live, dev->addr + e.addr, e.value, e.width);
+					reads++;
+					if (verify && memcmp(live, data, e.value)) {
+						for (k = 0; live[k] == data[k]; k++);
+						if (mismatches++ < 16) {
+							printf("entry %llu [%s]: block at %.8X differs from offset %#x\n",
+								(unsigned long long)n, context, e.addr, k & ~3);
+						}
+					}
+					free(live);
+				}
+				poll_addr = ~0u;
+				break;
+			default:
+				printf("Error: unknown entry type %d\n", e.type);
+				n = ~0ull;
+				break;
+		}
+		if (n == ~0ull) {
+			break;
+		}
+	}
+	free(data);
+	fclose(fp);
+	if (dma) {
+		dma_release(DMA_CHAN_BOTH);
+	}
+	printf("replayed %llu entries (%llu writes, %llu reads) in %.3f ms",
+		(unsigned long long)n, (unsigned long long)writes,
+		(unsigned long long)reads, (now_ns() - start) / 1e6);
+	if (verify) {
+		printf(", %llu mismatches", (unsigned long long)mismatches);
+	}
+	printf("\n");
+	return 0;
+}
+
+int record_session(device_t *dev, char *cmd)
+{
+	char path[256];
+
+	if ((sscanf(cmd, "%*s %255s", path) != 1) || (strcmp(path, "stop") == 0)) {
+		rec_stop();
+		return 0;
+	}
+	rec_stop();
+	if (rec_start(dev, path) == 0) {
+		printf("recording to %s\n", path);
+	}
+	return 0;
+}
+
+/* ----------------------------------------------------------------
+ * Background jobs
+ * ----------------------------------------------------------------
+ *
+ * "bg <command>" runs any command line on its own thread so the
+ * prompt stays free for register peeks and pokes. Long running
+ * commands check job_stopping() between iterations and publish
+ * live counters with job_count() and job_note(); "stats" reports
+ * them with the rate since the previous "stats".
+ *
+ * Plain MMIO accesses are not serialized: the BAR is mapped once
+ * and each load or store is a single bus transaction. (The iATU DBI
+ * window, which redirects the whole BAR, is never opened while jobs
+ * run.) What the hardware cannot share is a DMA channel, since
+ * programming the LLP and ringing the doorbell of a busy channel
+ * corrupts the run in progress. Each channel is claimed with dma_claim(), which also
+ * gives the owner the udmabuf0 scratch area and single-transfer
+ * descriptors used by that channel (RING_SRC_OFF and BENCH_DESC_OFF
+ * for the write channel, RING_DST_OFF and BENCH_DESC_OFF +
+ * BENCH_DESC_CHAN for the read channel).
+ */
+#define JOB_MAX             8
+
+typedef enum {
+	JOB_FREE,
+	JOB_RUNNING,
+	JOB_DONE
+} job_state_t;
+
+typedef struct {
+	int           id;
+	job_state_t   state;
+	volatile int  stop;
+	pthread_t     thread;
+	device_t     *dev;
+	char          cmd[256];
+	char          note[64];
+	uint64_t      start_ns;
+	uint64_t      end_ns;
+
+	/* Live counters, updated by the job thread */
+	uint64_t      iterations;
+	uint64_t      bytes;
+	uint64_t      errors;
+
+	/* Counters at the previous "stats", for interval rates */
+	uint64_t      seen_ns;
+	uint64_t      seen_bytes;
+} job_t;
+
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static job_t jobs[JOB_MAX];
+static int job_next_id = 1;
+static __thread job_t *job_self = NULL;
+
+static pthread_mutex_t dma_chan_lock[2] = {
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER
+};
+static int dma_chan_owner[2];      /* job id, 0 for the prompt */
+static const char *dma_chan_name[2] = { "write", "read" };
+
+/* Claim DMA channels (DMA_CHAN_WR and/or DMA_CHAN_RD). Without wait,
+ * a channel owned by someone else is reported and -1 returned.
+ */
+int dma_claim(int chans, int wait)
+{
+	int i, k;
+
+	for (i = 0; i < 2; i++) {
+		if (!(chans & (1 << i))) {
+			continue;
+		}
+		if (wait) {
+			pthread_mutex_lock(&dma_chan_lock[i]);
+		} else if (pthread_mutex_trylock(&dma_chan_lock[i]) != 0) {
+			if (dma_chan_owner[i]) {
+				printf("DMA %s channel is in use by job %d\n",
+					dma_chan_name[i], dma_chan_owner[i]);
+			} else {
+				printf("DMA %s channel is in use\n", dma_chan_name[i]);
+			}
+			for (k = 0; k < i; k++) {
+				if (chans & (1 << k)) {
+					pthread_mutex_unlock(&dma_chan_lock[k]);
+				}
+			}
+			return -1;
+		}
+		dma_chan_owner[i] = job_self ? job_self->id : 0;
+	}
+	return 0;
+}
+
+void dma_release(int chans)
+{
+	int i;
+
+	for (i = 1; i >= 0; i--) {
+		if (chans & (1 << i)) {
+			pthread_mutex_unlock(&dma_chan_lock[i]);
+		}
+	}
+}
+
+/* True when the calling job has been asked to stop */
+int job_stopping(void)
+{
+	return (job_self != NULL) && job_self->stop;
+}
+
+/* True when running as a background job */
+int job_active(void)
+{
+	return job_self != NULL;
+}
+
+/* True when a background job other than the caller is running */
+int job_others_running(void)
+{
+	job_t *job;
+	int running = 0;
+
+	pthread_mutex_lock(&job_lock);
+	for (job = jobs; job < jobs + JOB_MAX; job++) {
+		if ((job->state == JOB_RUNNING) && (job != job_self)) {
+			running = 1;
+		}
+	}
+	pthread_mutex_unlock(&job_lock);
+	return running;
+}
+
+void job_count(uint64_t iterations, uint64_t bytes, uint64_t errors)
+{
+	if (job_self == NULL) {
+		return;
+	}
+	__atomic_add_fetch(&job_self->iterations, iterations, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&job_self->bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&job_self->errors, errors, __ATOMIC_RELAXED);
+}
+
+/* Short free-form status shown by "stats" */
+void job_note(const char *fmt, ...)
+{
+	va_list ap;
+
+	if (job_self == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&job_lock);
+	va_start(ap, fmt);
+	vsnprintf(job_self->note, sizeof(job_self->note), fmt, ap);
+	va_end(ap);
+	pthread_mutex_unlock(&job_lock);
+}
+
+static void *job_thread(void *arg)
+{
+	job_t *job = arg;
+	char cmd[256];
+
+	job_self = job;
+	snprintf(cmd, sizeof(cmd), "%s", job->cmd);
+	process_command(job->dev, cmd);
+	fflush(stdout);
+
+	pthread_mutex_lock(&job_lock);
+	job->end_ns = now_ns();
+	job->state = JOB_DONE;
+	pthread_mutex_unlock(&job_lock);
+	return NULL;
+}
+
+/* Report finished jobs and free their slots; called before each prompt */
+void job_notify(void)
+{
+	job_t *job;
+
+	for (job = jobs; job < jobs + JOB_MAX; job++) {
+		pthread_mutex_lock(&job_lock);
+		if (job->state != JOB_DONE) {
+			pthread_mutex_unlock(&job_lock);
+			continue;
+		}
+		pthread_mutex_unlock(&job_lock);
+		pthread_join(job->thread, NULL);
+		printf("[%d] %s after %.1f s: %s\n", job->id,
+			job->stop ? "stopped" : "done",
+			(job->end_ns - job->start_ns) / 1e9, job->cmd);
+		job->state = JOB_FREE;
+	}
+}
+
+/* Stop every job and wait for them; called on exit */
+void job_shutdown(void)
+{
+	job_t *job;
+
+	for (job = jobs; job < jobs + JOB_MAX; job++) {
+		if (job->state == JOB_RUNNING) {
+			job->stop = 1;
+		}
+	}
+	job_notify();
+	for (job = jobs; job < jobs + JOB_MAX; job++) {
+		if (job->state != JOB_FREE) {
+			pthread_join(job->thread, NULL);
+			job->state = JOB_FREE;
+		}
+	}
+}
+
+static job_t *job_find(const char *arg)
+{
+	int id = atoi(arg);
+	job_t *job;
+
+	for (job = jobs; job < jobs + JOB_MAX; job++) {
+		if ((job->state != JOB_FREE) && (job->id == id)) {
+			return job;
+		}
+	}
+	printf("No job %s\n", arg);
+	return NULL;
+}
+
+int job_start(device_t *dev, char *cmd)
+{
+	job_t *job;
+	char *line = cmd + strcspn(cmd, " \t");
+
+	line += strspn(line, " \t");
+	if ((line[0] == '\0') || (line[0] == 'q') || (line[0] == 'Q') ||
+	    (strncmp(line, "bg", 2) == 0)) {
+		printf("Syntax error (use ? for help)\n");
+		return 0;
+	}
+	job_notify();
+	for (job = jobs; job < jobs + JOB_MAX; job++) {
+		if (job->state == JOB_FREE) {
+			break;
+		}
+	}
+	if (job == jobs + JOB_MAX) {
+		printf("Error: %d jobs already running\n", JOB_MAX);
+		return 0;
+	}
+
+	memset(job, 0, sizeof(*job));
+	job->id = job_next_id++;
+	job->dev = dev;
+	snprintf(job->cmd, sizeof(job->cmd), "%s", line);
+	job->start_ns = job->seen_ns = now_ns();
+	job->state = JOB_RUNNING;
+	if (pthread_create(&job->thread, NULL, job_thread, job) != 0) {
+		printf("Error: cannot start job thread\n");
+		job->state = JOB_FREE;
+		return 0;
+	}
+	printf("[%d] %s\n", job->id, job->cmd);
+	return 0;
+}
+
+int job_list(device_t *dev, char *cmd)
+{
+	job_t *job;
+	uint64_t now = now_ns();
+
+	for (job = jobs; job < jobs + JOB_MAX; job++) {
+		if (job->state == JOB_RUNNING) {
+			printf("[%d] %-8s %8.1f s  %s\n", job->id,
+				job->stop ? "stopping" : "running",
+				(now - job->start_ns) / 1e9, job->cmd);
+		}
+	}
+	job_notify();
+	return 0;
+}
+
+int job_stop(device_t *dev, char *cmd)
+{
+	char arg[16];
+	job_t *job;
+
+	if (sscanf(cmd, "%*s %15s", arg) != 1) {
+		printf("Syntax error (use ? for help)\n");
+		return 0;
+	}
+	if (strcmp(arg, "all") == 0) {
+		for (job = jobs; job < jobs + JOB_MAX; job++) {
+			if (job->state == JOB_RUNNING) {
+				job->stop = 1;
+			}
+		}
+		return 0;
+	}
+	job = job_find(arg);
+	if (job != NULL) {
+		job->stop = 1;
+	}
+	return 0;
+}
+
+int job_stats(device_t *dev, char *cmd)
+{
+	char arg[16];
+	job_t *job, *only = NULL;
+	uint64_t now, end, iterations, bytes, errors;
+	double total, interval;
+
+	if (sscanf(cmd, "%*s %15s", arg) == 1) {
+		only = job_find(arg);
+		if (only == NULL) {
+			return 0;
+		}
+	}
+	printf("%4s %12s %10s %14s %10s %10s  %s\n",
+		"job", "iterations", "errors", "bytes", "avg MB/s", "now MB/s", "status");
+	for (job = jobs; job < jobs + JOB_MAX; job++) {
+		if ((job->state == JOB_FREE) || ((only != NULL) && (job != only))) {
+			continue;
+		}
+		now = now_ns();
+		iterations = __atomic_load_n(&job->iterations, __ATOMIC_RELAXED);
+		bytes = __atomic_load_n(&job->bytes, __ATOMIC_RELAXED);
+		errors = __atomic_load_n(&job->errors, __ATOMIC_RELAXED);
+		end = (job->state == JOB_DONE) ? job->end_ns : now;
+		total = (end - job->start_ns) / 1e9;
+		interval = (now - job->seen_ns) / 1e9;
+
+		pthread_mutex_lock(&job_lock);
+		printf("[%2d] %12llu %10llu %14llu %10.2f %10.2f  %s\n", job->id,
+			(unsigned long long)iterations, (unsigned long long)errors,
+			(unsigned long long)bytes,
+			total > 0 ? bytes / total / 1e6 : 0.0,
+			(job->state == JOB_RUNNING) && (interval > 0) ?
+				(bytes - job->seen_bytes) / interval / 1e6 : 0.0,
+			job->note[0] ? job->note : job->cmd);
+		pthread_mutex_unlock(&job_lock);
+
+		job->seen_ns = now;
+		job->seen_bytes = bytes;
+	}
+	return 0;
+}
+
+/* Poll a register and report every change */
+int watch_mem(device_t *dev, char *cmd)
+{
+	const mmio_kernel_t *kernel = mmio_kernel_select(32);
+	unsigned int addr = 0;
+	unsigned int ms = 100;
+	unsigned int count = 0;
+	uint32_t value, last;
+	uint64_t start, samples = 0, changes = 0;
+	int status;
+
+	status = sscanf(cmd, "%*s %x %u %u", &addr, &ms, &count);
+	if ((status < 1) || (addr & 3)) {
+		printf("Syntax error (use ? for help)\n");
+		return 0;
+	}
+	if (addr + 4 > dev->size) {
+		printf("Error: invalid address (maximum allowed is %.8X\n", dev->size - 4);
+		return 0;
+	}
+	if ((count == 0) && !job_active()) {
+		printf("Error: watch without a sample count must run as a background job\n");
+		return 0;
+	}
+
+	start = now_ns();
+	kernel->read(dev, addr, &last, 1);
+	printf("watch %.8X: %.8X\n", addr, last);
+	while (!job_stopping() && ((count == 0) || (++samples < count))) {
+		usleep(ms * 1000);
+		kernel->read(dev, addr, &value, 1);
+		job_count(1, 4, 0);
+		if (value != last) {
+			changes++;
+			printf("watch %.8X: %.8X -> %.8X at +%.3f s\n", addr, last, value,
+				(now_ns() - start) / 1e9);
+			last = value;
+		}
+		job_note("%.8X = %.8X, %llu changes", addr, last,
+			(unsigned long long)changes);
+	}
+	return 0;
+}
+
+/* ----------------------------------------------------------------
+ * ATU window manager
+ * ----------------------------------------------------------------
+ *
+ * Windows are collected in atu_table ("atu set", "atu load") and
+ * programmed together by "atu apply". While bit 0 of config offset
+ * 0x81c is clear the BAR shows the iATU registers instead of the
+ * DMA engine, so all windows are written inside one such DBI access
+ * window, opened and closed through the sysfs config file and
+ * confirmed by reading the bit back rather than by sleeping. The
+ * regions are then read back in a single pass before the window is
+ * closed. The DMA channels are claimed for the duration because the
+ * engine registers are not reachable meanwhile.
+ *
+ * Any other BAR access while the window is open would reach the iATU
+ * as well ('bg watch', 'bg d', ...). So the window is only opened
+ * outside background jobs and while none are running. Daemon register
+ * requests and command lines are already kept out by device_lock.
+ *
+ * Unrolled iATU layout: outbound region i at i << 9, inbound region
+ * i at (i << 9) | 0x100.
+ */
+#define ATU_DBI_CTRL         0x81c
+#define ATU_DBI_NORMAL       0x01      /* set: BAR shows the DMA engine */
+#define ATU_REGIONS          16
+#define ATU_MAX              (2 * ATU_REGIONS)
+
+#define ATU_CTRL1            0x00
+#define ATU_CTRL2            0x04
+#define ATU_LOWER_BASE       0x08
+#define ATU_UPPER_BASE       0x0c
+#define ATU_LIMIT            0x10
+#define ATU_LOWER_TARGET     0x14
+#define ATU_UPPER_TARGET     0x18
+#define ATU_CTRL2_ENABLE     0x80000000
+
+static atu_window_t atu_table[ATU_MAX];
+static int atu_count = 0;
+
+static unsigned int atu_offset(const atu_window_t *w)
+{
+	return (w->index << 9) | (w->inbound ? 0x100 : 0);
+}
+
+/* "in|out index base limit target [ctrl1]" or "in|out index off" */
+static int atu_parse(const char *str, atu_window_t *w)
+{
+	char dir[8], arg[16];
+	unsigned long long base, target;
+	unsigned int limit;
+	int status;
+
+	memset(w, 0, sizeof(*w));
+	status = sscanf(str, "%7s %d %15s", dir, &w->index, arg);
+	if ((status != 3) || (strcmp(dir, "in") && strcmp(dir, "out")) ||
+	    (w->index < 0) || (w->index >= ATU_REGIONS)) {
+		return -1;
+	}
+	w->inbound = (dir[0] == 'i');
+	if (strcmp(arg, "off") == 0) {
+		return 0;
+	}
+	status = sscanf(str, "%*s %*d %llx %x %llx %x", &base, &limit, &target, &w->ctrl1);
+	if ((status < 3) || (limit < (uint32_t)base)) {
+		return -1;
+	}
+	w->enable = 1;
+	w->base = base;
+	w->limit = limit;
+	w->target = target;
+	return 0;
+}
+
+static void atu_print(const atu_window_t *w)
+{
+	if (!w->enable) {
+		printf("  %-3s %2d  off\n", w->inbound ? "in" : "out", w->index);
+		return;
+	}
+	printf("  %-3s %2d  %.16llX-%.8X -> %.16llX  ctrl1 %.8X\n",
+		w->inbound ? "in" : "out", w->index, (unsigned long long)w->base,
+		w->limit, (unsigned long long)w->target, w->ctrl1);
+}
+
+/* Add or replace the table entry for the same region */
+static int atu_table_set(const atu_window_t *w)
+{
+	int i;
+
+	for (i = 0; i < atu_count; i++) {
+		if ((atu_table[i].inbound == w->inbound) && (atu_table[i].index == w->index)) {
+			break;
+		}
+	}
+	if (i == ATU_MAX) {
+		return -1;
+	}
+	atu_table[i] = *w;
+	if (i == atu_count) {
+		atu_count++;
+	}
+	return 0;
+}
+
+/* Open (or close) the DBI access window */
+static int atu_dbi(device_t *dev, int open)
+{
+	char dir[64], setpci[64];
+	uint8_t v, check;
+
+	if (open && job_active()) {
+		printf("Error: the DBI window cannot be opened from a background job\n");
+		return -1;
+	}
+	if (open && job_others_running()) {
+		printf("Error: stop the background jobs before opening the DBI window\n");
+		return -1;
+	}
+	snprintf(dir, sizeof(dir), "/sys/bus/pci/devices/%04x:%02x:%02x.%1x",
+		dev->domain, dev->bus, dev->slot, dev->function);
+	if (cfg_access(dir, 0, ATU_DBI_CTRL, &v, 1) < 0) {
+		printf("Error: cannot read config offset %#x of %s\n", ATU_DBI_CTRL, dir);
+		return -1;
+	}
+	v = open ? (v & ~ATU_DBI_NORMAL) : (v | ATU_DBI_NORMAL);
+	if (rec_fp != NULL) {
+		snprintf(setpci, sizeof(setpci), "setpci -s %02x:%02x.%x %x.b=%x:%x",
+			dev->bus, dev->slot, dev->function, ATU_DBI_CTRL,
+			open ? 0 : ATU_DBI_NORMAL, ATU_DBI_NORMAL);
+		rec_data(REC_SETPCI, 0, 0, setpci, strlen(setpci));
+	}
+	if ((cfg_access(dir, 1, ATU_DBI_CTRL, &v, 1) < 0) ||
+	    (cfg_access(dir, 0, ATU_DBI_CTRL, &check, 1) < 0) ||
+	    ((check ^ v) & ATU_DBI_NORMAL)) {
+		printf("Error: cannot %s the DBI window (config %#x)\n",
+			open ? "open" : "close", ATU_DBI_CTRL);
+		return -1;
+	}
+	return 0;
+}
+
+static void atu_read(device_t *dev, atu_window_t *w)
+{
+	unsigned int off = atu_offset(w);
+
+	w->ctrl1 = read_le32(dev, off + ATU_CTRL1);
+	w->enable = !!(read_le32(dev, off + ATU_CTRL2) & ATU_CTRL2_ENABLE);
+	w->base = ((uint64_t)read_le32(dev, off + ATU_UPPER_BASE) << 32) |
+		read_le32(dev, off + ATU_LOWER_BASE);
+	w->limit = read_le32(dev, off + ATU_LIMIT);
+	w->target = ((uint64_t)read_le32(dev, off + ATU_UPPER_TARGET) << 32) |
+		read_le32(dev, off + ATU_LOWER_TARGET);
+}
+
+/* Program windows in one DBI window and verify them. The stores are
+ * plain posted writes; the read-back pass flushes them. Returns the
+ * number of mismatching windows, or -1 if nothing was programmed or
+ * the DBI window could not be closed again.
+ */
+int atu_program(device_t *dev, const atu_window_t *win, int count)
+{
+	atu_window_t got;
+	unsigned int off;
+	uint64_t start = now_ns();
+	int i, bad = 0;
+
+	for (i = 0; i < count; i++) {
+		if (atu_offset(&win[i]) + ATU_UPPER_TARGET + 4 > dev->size) {
+			printf("Error: region %s %d is outside the BAR\n",
+				win[i].inbound ? "in" : "out", win[i].index);
+			return -1;
+		}
+	}
+	if (dma_claim(DMA_CHAN_BOTH, 0) < 0) {
+		return -1;
+	}
+	if (atu_dbi(dev, 1) < 0) {
+		dma_release(DMA_CHAN_BOTH);
+		return -1;
+	}
+
+	/* Disable first and enable last so no half-written window decodes */
+	for (i = 0; i < count; i++) {
+		off = atu_offset(&win[i]);
+		store_le32(dev, off + ATU_CTRL2, 0);
+		if (!win[i].enable) {
+			continue;
+		}
+		store_le32(dev, off + ATU_LOWER_BASE, (uint32_t)win[i].base);
+		store_le32(dev, off + ATU_UPPER_BASE, (uint32_t)(win[i].base >> 32));
+		store_le32(dev, off + ATU_LIMIT, win[i].limit);
+		store_le32(dev, off + ATU_LOWER_TARGET, (uint32_t)win[i].target);
+		store_le32(dev, off + ATU_UPPER_TARGET, (uint32_t)(win[i].target >> 32));
+		store_le32(dev, off + ATU_CTRL1, win[i].ctrl1);
+		store_le32(dev, off + ATU_CTRL2, ATU_CTRL2_ENABLE);
+	}
+
+	for (i = 0; i < count; i++) {
+		got = win[i];
+		atu_read(dev, &got);
+		/* Address bits below the 4 KB region granule are hardwired */
+		if ((got.enable != win[i].enable) || (win[i].enable &&
+		    ((got.ctrl1 != win[i].ctrl1) ||
+		     ((got.base ^ win[i].base) & ~0xfffull) ||
+		     ((got.limit ^ win[i].limit) & ~0xfffu) ||
+		     ((got.target ^ win[i].target) & ~0xfffull)))) {
+			if (bad++ == 0) {
+				printf("read-back mismatch (wanted, got):\n");
+			}
+			atu_print(&win[i]);
+			atu_print(&got);
+		}
+	}
+
+	if (atu_dbi(dev, 0) < 0) {
+		/* BAR0 still decodes as iATU registers, not the DMA engine */
+		dma_release(DMA_CHAN_BOTH);
+		return -1;
+	}
+	dma_release(DMA_CHAN_BOTH);
+	printf("atu: %d window%s programmed in %.3f ms, %d mismatch%s\n", count,
+		(count == 1) ? "" : "s", (now_ns() - start) / 1e6, bad,
+		(bad == 1) ? "" : "es");
+	return bad;
+}
+
+/* Show the enabled regions as currently programmed */
+static void atu_list_hw(device_t *dev)
+{
+	atu_window_t w;
+	int dir, i;
+
+	if (dma_claim(DMA_CHAN_BOTH, 0) < 0) {
+		return;
+	}
+	if (atu_dbi(dev, 1) < 0) {
+		dma_release(DMA_CHAN_BOTH);
+		return;
+	}
+	printf("programmed:\n");
+	for (dir = 0; dir < 2; dir++) {
+		for (i = 0; i < ATU_REGIONS; i++) {
+			memset(&w, 0, sizeof(w));
+			w.inbound = dir;
+			w.index = i;
+			if (atu_offset(&w) + ATU_UPPER_TARGET + 4 > dev->size) {
+				break;
+			}
+			atu_read(dev, &w);
+			if (w.enable) {
+				atu_print(&w);
+			}
+		}
+	}
+	if (atu_dbi(dev, 0) < 0) {
+		printf("Warning: BAR0 is still mapped to the iATU registers\n");
+	}
+	dma_release(DMA_CHAN_BOTH);
+}
+
+static int atu_load(const char *path)
+{
+	atu_window_t w;
+	char line[256];
+	int n = 0, lineno = 0;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		printf("Open failed for file '%s': errno %d, %s\n", path, errno, strerror(errno));
+		return -1;
+	}
+	atu_count = 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		line[strcspn(line, "#\r\n")] = '\0';
+		if (line[strspn(line, " \t")] == '\0') {
+			continue;
+		}
+		if ((atu_parse(line, &w) < 0) || (atu_table_set(&w) < 0)) {
+			printf("%s:%d: syntax error\n", path, lineno);
+			atu_count = 0;
+			fclose(fp);
+			return -1;
+		}
+		n++;
+	}
+	fclose(fp);
+	printf("atu: %d window%s loaded\n", n, (n == 1) ? "" : "s");
+	return 0;
+}
+
+int atu_command(device_t *dev, char *cmd)
+{
+	atu_window_t w;
+	char arg[16] = "", path[256];
+	char *rest;
+	int i;
+
+	sscanf(cmd, "%*s %15s", arg);
+	rest = cmd + strcspn(cmd, " \t");
+	rest += strspn(rest, " \t");
+	rest += strcspn(rest, " \t");
+
+	if ((arg[0] == '\0') || !strcmp(arg, "list")) {
+		printf("table:\n");
+		for (i = 0; i < atu_count; i++) {
+			atu_print(&atu_table[i]);
+		}
+		atu_list_hw(dev);
+	} else if (!strcmp(arg, "set")) {
+		if ((atu_parse(rest, &w) < 0) || (atu_table_set(&w) < 0)) {
+			printf("Syntax error (use ? for help)\n");
+		}
+	} else if (!strcmp(arg, "clear")) {
+		atu_count = 0;
+	} else if (!strcmp(arg, "load") && (sscanf(rest, "%255s", path) == 1)) {
+		atu_load(path);
+	} else if (!strcmp(arg, "apply")) {
+		if (atu_count == 0) {
+			printf("atu: table is empty\n");
+		} else {
+			atu_program(dev, atu_table, atu_count);
+		}
+	} else {
+		printf("Syntax error (use ? for help)\n");
+	}
+	return 0;
+}
+
+/* ----------------------------------------------------------------
+ * Raw pointer read/write access
+ * ----------------------------------------------------------------
+ */
+static void
+write_8(
+	device_t      *dev,
+	unsigned int   addr,
+	unsigned char  data)
+{
+	*(volatile unsigned char *)(dev->addr + addr) = data;
+	msync((void *)(dev->addr + addr), 1, MS_SYNC | MS_INVALIDATE);
+	if (rec_fp != NULL) {
+		rec_access(REC_WRITE, 1, addr, data);
+	}
+}
+
+static void
+write_le16(
+	device_t      *dev,
+	unsigned int   addr,
+	unsigned short int data)
+{
+	if (__BYTE_ORDER != __LITTLE_ENDIAN) {
+		data = bswap_16(data);
+	}
+	*(volatile unsigned short int *)(dev->addr + addr) = data;
+	msync((void *)(dev->addr + addr), 2, MS_SYNC | MS_INVALIDATE);
+	if (rec_fp != NULL) {
+		rec_access(REC_WRITE, 2, addr, data);
+	}
+}
+
+static void
+write_be16(
+	device_t      *dev,
+	unsigned int   addr,
+	unsigned short int data)
+{
+	if (__BYTE_ORDER == __LITTLE_ENDIAN) {
+		data = bswap_16(data);
+	}
+	*(volatile unsigned short int *)(dev->addr + addr) = data;
+	msync((void *)(dev->addr + addr), 2, MS_SYNC | MS_INVALIDATE);
+	if (rec_fp != NULL) {
+		rec_access(REC_WRITE, 2, addr, data);
+	}
+}
+
+static void
 write_le32(
 	device_t      *dev,
 	unsigned int   addr,
@@ -983,6 +5738,25 @@ write_le32(
 	}
 	*(volatile unsigned int *)(dev->addr + addr) = data;
 	msync((void *)(dev->addr + addr), 4, MS_SYNC | MS_INVALIDATE);
+	if (rec_fp != NULL) {
+		rec_access(REC_WRITE, 4, addr, data);
+	}
+}
+
+/* write_le32() without the usleep() and msync(), for timed and batched paths */
+static void
+store_le32(
+	device_t      *dev,
+	unsigned int   addr,
+	unsigned int data)
+{
+	if (__BYTE_ORDER != __LITTLE_ENDIAN) {
+		data = bswap_32(data);
+	}
+	*(volatile unsigned int *)(dev->addr + addr) = data;
+	if (rec_fp != NULL) {
+		rec_access(REC_WRITE, 4, addr, data);
+	}
 }
 
 static unsigned int
@@ -991,6 +5765,9 @@ read_le32(
 	unsigned int   addr)
 {
 	unsigned int data = *(volatile unsigned int *)(dev->addr + addr);
+	if (rec_fp != NULL) {
+		rec_access(REC_READ, 4, addr, data);
+	}
 	if (__BYTE_ORDER != __LITTLE_ENDIAN) {
 		data = bswap_32(data);
 	}
@@ -1008,17 +5785,8 @@ write_be32(
 	}
 	*(volatile unsigned int *)(dev->addr + addr) = data;
 	msync((void *)(dev->addr + addr), 4, MS_SYNC | MS_INVALIDATE);
-}
-
-static unsigned int
-read_be32(
-	device_t      *dev,
-	unsigned int   addr)
-{
-	unsigned int data = *(volatile unsigned int *)(dev->addr + addr);
-	if (__BYTE_ORDER == __LITTLE_ENDIAN) {
-		data = bswap_32(data);
+	if (rec_fp != NULL) {
+		rec_access(REC_WRITE, 4, addr, data);
 	}
-	return data;
 }
 